@@ -0,0 +1,423 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Micro-benchmarks of the library hot paths. Runs headless, without GPIO
+// access or root, so it works on any machine; numbers are only comparable
+// between runs on the same machine.
+
+#include "content-streamer.h"
+#include "gpio-recorder.h"
+#include "graphics.h"
+#include "led-matrix.h"
+#include "pixel-mapper.h"
+#include "multiplex-mappers-internal.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace rgb_matrix;
+using rgb_matrix::internal::MultiplexMapper;
+using rgb_matrix::internal::MuxMapperList;
+using rgb_matrix::internal::GetRegisteredMultiplexMappers;
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Micro-benchmarks of the library, without hardware. The "
+          "default geometry is\n64x64 panels, chain of 4, 3 parallel.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-f <font-file>    : Font for the text benchmarks "
+          "(Default: ../fonts/7x13.bdf)\n"
+          "\t-m <millis>       : Minimum time to run each benchmark "
+          "(Default: 200)\n"
+          "\t-b <name>         : Only run benchmarks containing this name.\n");
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static int64_t min_run_ns = 200 * 1000000LL;
+static const char *name_filter = NULL;
+
+// Report one benchmark. "pixels" is the number of pixels touched per
+// operation, 0 if that doesn't make sense.
+static void Report(const char *name, double ns_per_op, int64_t pixels) {
+  printf("%-48s %12.0f ns/op", name, ns_per_op);
+  if (pixels > 0) {
+    printf(" %8.2f ns/pixel", ns_per_op / pixels);
+  } else {
+    printf(" %17s", "");
+  }
+  printf(" %10.1f ops/s\n", ns_per_op > 0 ? 1e9 / ns_per_op : 0);
+  fflush(stdout);
+}
+
+static bool Selected(const char *name) {
+  return name_filter == NULL || strstr(name, name_filter) != NULL;
+}
+
+// Call "op" with doubling iteration counts until it ran long enough, then
+// return the nanoseconds per call.
+template <class Operation>
+static double NanosPerCall(Operation op) {
+  op();  // Warm up caches and lazy allocations.
+  for (int64_t iterations = 1; /**/; iterations *= 2) {
+    const int64_t start = MonotonicNanos();
+    for (int64_t i = 0; i < iterations; ++i) {
+      op();
+    }
+    const int64_t duration = MonotonicNanos() - start;
+    if (duration >= min_run_ns || iterations >= (1LL << 40)) {
+      return (double)duration / iterations;
+    }
+  }
+}
+
+template <class Operation>
+static void Run(const char *name, int64_t pixels, Operation op) {
+  if (!Selected(name)) return;
+  Report(name, NanosPerCall(op), pixels);
+}
+
+static void BenchmarkCanvas(FrameCanvas *canvas, const Font *font) {
+  const int width = canvas->width();
+  const int height = canvas->height();
+  const int64_t pixels = (int64_t)width * height;
+  int frame = 0;
+
+  Run("SetPixel (full frame)", pixels, [&]() {
+      ++frame;
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          canvas->SetPixel(x, y, x + frame, y, x ^ y);
+        }
+      }
+    });
+  Run("Fill", pixels, [&]() { canvas->Fill(++frame, 128, 64); });
+  Run("Clear", pixels, [&]() { canvas->Clear(); });
+  const int sub_width = width / 2, sub_height = height / 2;
+  Run("SubFill (quarter of the frame)", (int64_t)sub_width * sub_height,
+      [&]() {
+        canvas->SubFill(width / 4, height / 4, sub_width, sub_height,
+                        ++frame, 128, 64);
+      });
+
+  std::vector<uint8_t> image(pixels * 3);
+  for (size_t i = 0; i < image.size(); ++i) image[i] = i * 7;
+  Run("SetImage (RGB, full frame)", pixels, [&]() {
+      SetImage(canvas, 0, 0, image.data(), image.size(), width, height,
+               false);
+    });
+  Run("SetImage (BGR, full frame)", pixels, [&]() {
+      SetImage(canvas, 0, 0, image.data(), image.size(), width, height,
+               true);
+    });
+
+  const Color red(255, 0, 0), blue(0, 0, 255);
+  Run("DrawLine (diagonal)", std::max(width, height), [&]() {
+      DrawLine(canvas, 0, 0, width - 1, height - 1, red);
+    });
+  Run("DrawLine (horizontal)", width, [&]() {
+      DrawLine(canvas, 0, height / 2, width - 1, height / 2, red);
+    });
+  const int radius = std::min(width, height) / 2 - 1;
+  Run("DrawCircle", 0, [&]() {
+      DrawCircle(canvas, width / 2, height / 2, radius, blue);
+    });
+
+  if (font == NULL) return;
+  const int glyph_pixels = font->CharacterWidth('W') * font->height();
+  Run("Font::DrawGlyph", glyph_pixels, [&]() {
+      font->DrawGlyph(canvas, 10, font->baseline(), red, &blue, 'W');
+    });
+  const char kText[] = "The quick brown fox jumps over the lazy dog";
+  const int64_t text_pixels =
+    (int64_t)font->CharacterWidth('x') * font->height() * (sizeof(kText) - 1);
+  Run("DrawText (43 chars)", text_pixels, [&]() {
+      DrawText(canvas, *font, 0, font->baseline(), red, NULL, kText);
+    });
+  Run("DrawText (43 chars, background)", text_pixels, [&]() {
+      DrawText(canvas, *font, 0, font->baseline(), red, &blue, kText);
+    });
+}
+
+static void BenchmarkStreaming(RGBMatrix *matrix, FrameCanvas *canvas) {
+  FrameCanvas *received = matrix->CreateFrameCanvas();
+  const int64_t pixels = (int64_t)canvas->width() * canvas->height();
+  Run("StreamWriter::Stream", pixels, [&]() {
+      MemStreamIO io;
+      StreamWriter writer(&io);
+      writer.Stream(*canvas, 0);
+    });
+
+  // Reading has to rewind, so keep a stream of a single frame around.
+  MemStreamIO frames;
+  StreamWriter(&frames).Stream(*canvas, 0);
+  StreamReader reader(&frames);
+  uint32_t hold_time_us;
+  Run("StreamReader::GetNext", pixels, [&]() {
+      reader.Rewind();
+      reader.GetNext(received, &hold_time_us);
+    });
+
+  Run("Stream round trip", pixels, [&]() {
+      MemStreamIO io;
+      StreamWriter(&io).Stream(*canvas, 0);
+      StreamReader round_trip_reader(&io);
+      round_trip_reader.GetNext(received, &hold_time_us);
+    });
+}
+
+// Like NanosPerCall(), but "prepare" runs untimed before each call.
+template <class Prepare, class Operation>
+static double NanosPerPreparedCall(Prepare prepare, Operation op) {
+  const int64_t give_up = MonotonicNanos() + 10 * min_run_ns;
+  int64_t calls = 0, duration = 0;
+  while (duration < min_run_ns && (calls < 3 || MonotonicNanos() < give_up)) {
+    prepare();
+    const int64_t start = MonotonicNanos();
+    op();
+    duration += MonotonicNanos() - start;
+    ++calls;
+  }
+  return (double)duration / calls;
+}
+
+// ApplyPixelMapper() to a fresh headless matrix each time.
+static void RunApplyPixelMapper(const char *name,
+                                const RGBMatrix::Options &options,
+                                const RuntimeOptions &runtime,
+                                const PixelMapper *mapper) {
+  RGBMatrix *matrix = NULL;
+  const double ns = NanosPerPreparedCall(
+    [&]() {
+      delete matrix;
+      matrix = RGBMatrix::CreateFromOptions(options, runtime);
+    },
+    [&]() { matrix->ApplyPixelMapper(mapper); });
+  const int64_t pixels = (int64_t)matrix->width() * matrix->height();
+  delete matrix;
+  Report(name, ns, pixels);
+}
+
+// The parameter that makes a registered mapper usable with this geometry.
+static const char *MapperParameter(const std::string &name,
+                                   const RGBMatrix::Options &options,
+                                   std::string *buffer) {
+  if (name == "Rotate") return "90";
+  if (name == "Mirror") return "H";
+  if (name == "Remap") {
+    // Same layout as without mapper, just going through the remapping.
+    char tile[32];
+    snprintf(tile, sizeof(tile), "%d,%d", options.cols * options.chain_length,
+             options.rows * options.parallel);
+    *buffer = tile;
+    for (int p = 0; p < options.parallel; ++p) {
+      for (int c = 0; c < options.chain_length; ++c) {
+        snprintf(tile, sizeof(tile), "|%d,%dn",
+                 c * options.cols, p * options.rows);
+        *buffer += tile;
+      }
+    }
+    return buffer->c_str();
+  }
+  return NULL;
+}
+
+// Multiplexers are made for particular panels; check if the one with
+// "cols" x "rows" maps within its physical layout. Also has the
+// multiplexer remember this panel size.
+static bool MultiplexerFits(const MultiplexMapper *mux, int cols, int rows) {
+  int matrix_cols = cols, matrix_rows = rows;
+  mux->EditColsRows(&matrix_cols, &matrix_rows);
+  int visible_width, visible_height;
+  if (matrix_rows < 1 || matrix_cols < 1
+      || !mux->GetSizeMapping(matrix_cols, matrix_rows,
+                              &visible_width, &visible_height)) {
+    return false;
+  }
+  for (int y = 0; y < visible_height; ++y) {
+    for (int x = 0; x < visible_width; ++x) {
+      int matrix_x = -1, matrix_y = -1;
+      mux->MapVisibleToMatrix(matrix_cols, matrix_rows, x, y,
+                              &matrix_x, &matrix_y);
+      if (matrix_x < 0 || matrix_y < 0
+          || matrix_x >= matrix_cols || matrix_y >= matrix_rows) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void BenchmarkPixelMappers(const RGBMatrix::Options &defaults,
+                                  const RuntimeOptions &runtime) {
+  RGBMatrix::Options options = defaults;
+  options.pixel_mapper_config = NULL;
+  options.multiplexing = 0;
+
+  const std::vector<std::string> mappers = GetAvailablePixelMappers();
+  for (size_t i = 0; i < mappers.size(); ++i) {
+    const std::string name = "ApplyPixelMapper " + mappers[i];
+    if (!Selected(name.c_str())) continue;
+    std::string buffer;
+    const PixelMapper *mapper =
+      FindPixelMapper(mappers[i].c_str(), options.chain_length,
+                      options.parallel,
+                      MapperParameter(mappers[i], options, &buffer));
+    if (mapper == NULL) {
+      printf("%-48s (not usable with this geometry)\n", name.c_str());
+      continue;
+    }
+    RunApplyPixelMapper(name.c_str(), options, runtime, mapper);
+  }
+
+  // Panels to try if a multiplexer doesn't fit the configured one.
+  const int kPanels[][2] = {
+    { defaults.cols, defaults.rows },
+    { 32, 16 }, { 32, 32 }, { 64, 32 }, { 80, 40 },
+  };
+  const MuxMapperList &multiplexers = GetRegisteredMultiplexMappers();
+  for (size_t i = 0; i < multiplexers.size(); ++i) {
+    const MultiplexMapper *const mux = multiplexers[i];
+    char name[96];
+    snprintf(name, sizeof(name), "ApplyPixelMapper mux %d %s",
+             (int)i + 1, mux->GetName());
+    if (!Selected(name)) continue;
+    bool found = false;
+    for (size_t p = 0; !found && p < sizeof(kPanels) / sizeof(kPanels[0]);
+         ++p) {
+      if (!MultiplexerFits(mux, kPanels[p][0], kPanels[p][1])) continue;
+      // The matrix with the physical layout, which the multiplexer turns
+      // into the panels as seen by the user.
+      options.cols = kPanels[p][0];
+      options.rows = kPanels[p][1];
+      mux->EditColsRows(&options.cols, &options.rows);
+      std::string error;
+      if (!options.Validate(&error)) continue;
+      snprintf(name + strlen(name), sizeof(name) - strlen(name), " (%dx%d)",
+               kPanels[p][0], kPanels[p][1]);
+      RunApplyPixelMapper(name, options, runtime, mux);
+      found = true;
+    }
+    if (!found) printf("%-48s (no panel size fits)\n", name);
+  }
+}
+
+// The refresh thread writing to a recorder instead of the GPIO, as fast as
+// the CPU allows.
+static void BenchmarkRefresh(const RGBMatrix::Options &options,
+                             const RuntimeOptions &defaults) {
+  if (!Selected("Refresh")) return;
+  GPIOTrace trace(0);  // Only count the writes.
+  RuntimeOptions runtime = defaults;
+  runtime.gpio_recorder = &trace;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  if (matrix == NULL) return;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  for (int y = 0; y < canvas->height(); ++y) {
+    for (int x = 0; x < canvas->width(); ++x) {
+      canvas->SetPixel(x, y, x * 3, y * 5, x ^ y);
+    }
+  }
+  matrix->SwapOnVSync(canvas);
+
+  const uint64_t start_frames = matrix->GetRefreshStats().frames;
+  const int64_t start = MonotonicNanos();
+  while (MonotonicNanos() - start < min_run_ns) {
+    usleep(10000);
+  }
+  const uint64_t frames = matrix->GetRefreshStats().frames - start_frames;
+  const int64_t duration = MonotonicNanos() - start;
+  const uint64_t total_frames = matrix->GetRefreshStats().frames;
+  const int64_t pixels = (int64_t)canvas->width() * canvas->height();
+  delete matrix;  // Stops the refresh, now the write count is exact.
+
+  if (frames == 0) {
+    printf("%-48s (no frame finished)\n", "Refresh");
+    return;
+  }
+  Report("Refresh (recorded GPIO)", (double)duration / frames, pixels);
+  printf("%-48s %12.0f writes/frame\n", "",
+         (double)trace.writes() / (total_frames ? total_frames : 1));
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  matrix_options.rows = 64;
+  matrix_options.cols = 64;
+  matrix_options.chain_length = 4;
+  matrix_options.parallel = 3;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  runtime_opt.do_gpio_init = false;
+  runtime_opt.drop_privileges = 0;  // Nothing to drop, no hardware touched.
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  const char *font_file = "../fonts/7x13.bdf";
+  int opt;
+  while ((opt = getopt(argc, argv, "f:m:b:")) != -1) {
+    switch (opt) {
+    case 'f': font_file = strdup(optarg); break;
+    case 'm': min_run_ns = atoi(optarg) * 1000000LL; break;
+    case 'b': name_filter = strdup(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  Font font;
+  const bool have_font = font.LoadFont(font_file);
+  if (!have_font) {
+    fprintf(stderr, "Couldn't load font '%s'; skipping text benchmarks.\n",
+            font_file);
+  }
+
+  // Headless: the matrix has its framebuffers, but nothing refreshes.
+  RuntimeOptions headless = runtime_opt;
+  headless.do_gpio_init = false;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, headless);
+  if (matrix == NULL)
+    return 1;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  printf("Canvas %dx%d (%d pixels)\n\n",
+         canvas->width(), canvas->height(),
+         canvas->width() * canvas->height());
+
+  BenchmarkCanvas(canvas, have_font ? &font : NULL);
+  BenchmarkStreaming(matrix, canvas);
+  delete matrix;
+
+  BenchmarkPixelMappers(matrix_options, headless);
+  BenchmarkRefresh(matrix_options, headless);
+  return 0;
+}
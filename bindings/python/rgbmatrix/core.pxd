@@ -21,6 +21,9 @@ cdef class RGBMatrixOptions:
     cdef bytes __py_encoded_panel_type
     cdef bytes __py_encoded_drop_priv_user
     cdef bytes __py_encoded_drop_priv_group
+    cdef bytes __py_encoded_sleep_jitter_file
+    cdef bytes __py_encoded_refresh_policy
+    cdef bytes __py_encoded_pixel_mapping_cache
 
 # Local Variables:
 # mode: python
@@ -1,7 +1,7 @@
 # distutils: language = c++
 
 from libcpp cimport bool
-from libc.stdint cimport uint8_t, uint32_t, uintptr_t
+from libc.stdint cimport uint8_t, uint32_t, uintptr_t, int64_t
 import cython
 
 cdef extern from "Python.h":
@@ -166,6 +166,22 @@ cdef class RGBMatrixOptions:
         def __get__(self): return self.__options.inverse_colors
         def __set__(self, value): self.__options.inverse_colors = value
 
+    property pulse_brightness:
+        def __get__(self): return self.__options.pulse_brightness
+        def __set__(self, value): self.__options.pulse_brightness = value
+
+    property display_list:
+        def __get__(self): return self.__options.display_list
+        def __set__(self, value): self.__options.display_list = value
+
+    property phase_timing:
+        def __get__(self): return self.__options.phase_timing
+        def __set__(self, value): self.__options.phase_timing = value
+
+    property sched_deadline:
+        def __get__(self): return self.__options.sched_deadline
+        def __set__(self, value): self.__options.sched_deadline = value
+
     property led_rgb_sequence:
         def __get__(self): return self.__options.led_rgb_sequence
         def __set__(self, value):
@@ -219,6 +235,32 @@ cdef class RGBMatrixOptions:
             self.__py_encoded_drop_priv_group = value.encode('utf-8')
             self.__runtime_options.drop_priv_group = self.__py_encoded_drop_priv_group
 
+    property sleep_jitter_file:
+        def __get__(self): return self.__runtime_options.sleep_jitter_file
+        def __set__(self, value):
+            self.__py_encoded_sleep_jitter_file = value.encode('utf-8')
+            self.__runtime_options.sleep_jitter_file = self.__py_encoded_sleep_jitter_file
+
+    property refresh_cpu:
+        def __get__(self): return self.__runtime_options.refresh_cpu
+        def __set__(self, int value): self.__runtime_options.refresh_cpu = value
+
+    property refresh_priority:
+        def __get__(self): return self.__runtime_options.refresh_priority
+        def __set__(self, int value): self.__runtime_options.refresh_priority = value
+
+    property refresh_policy:
+        def __get__(self): return self.__runtime_options.refresh_policy
+        def __set__(self, value):
+            self.__py_encoded_refresh_policy = value.encode('utf-8')
+            self.__runtime_options.refresh_policy = self.__py_encoded_refresh_policy
+
+    property pixel_mapping_cache:
+        def __get__(self): return self.__runtime_options.pixel_mapping_cache
+        def __set__(self, value):
+            self.__py_encoded_pixel_mapping_cache = value.encode('utf-8')
+            self.__runtime_options.pixel_mapping_cache = self.__py_encoded_pixel_mapping_cache
+
 cdef class RGBMatrix(Canvas):
     def __cinit__(self, int rows = 0, int chains = 0, int parallel = 0,
         RGBMatrixOptions options = None):
@@ -270,6 +312,24 @@ cdef class RGBMatrix(Canvas):
     def SwapOnVSync(self, FrameCanvas newFrame, uint8_t framerate_fraction = 1):
         return __createFrameCanvas(self.__matrix.SwapOnVSync(newFrame.__canvas, framerate_fraction))
 
+    # Non-blocking "latest frame wins" alternative to SwapOnVSync(): the
+    # mailbox keeps queue_depth canvases; SwapLatest() posts a finished frame
+    # and returns a free canvas right away.
+    def CreateMailbox(self, int queue_depth = 3):
+        return __createFrameCanvas(self.__matrix.CreateMailbox(queue_depth))
+
+    def SwapLatest(self, FrameCanvas newFrame):
+        return __createFrameCanvas(self.__matrix.SwapLatest(newFrame.__canvas))
+
+    # Frames with presentation time: QueueFrame() shows newFrame at the first
+    # refresh at or after present_at_us, a CLOCK_MONOTONIC time in
+    # microseconds, e.g. int(time.monotonic() * 1e6). Returns a free canvas.
+    def CreateFrameQueue(self, int queue_depth = 3):
+        return __createFrameCanvas(self.__matrix.CreateFrameQueue(queue_depth))
+
+    def QueueFrame(self, FrameCanvas newFrame, int64_t present_at_us):
+        return __createFrameCanvas(self.__matrix.QueueFrame(newFrame.__canvas, present_at_us))
+
     property luminanceCorrect:
         def __get__(self): return self.__matrix.luminance_correct()
         def __set__(self, luminanceCorrect): self.__matrix.set_luminance_correct(luminanceCorrect)
@@ -1,5 +1,5 @@
 from libcpp cimport bool
-from libc.stdint cimport uint8_t, uint32_t
+from libc.stdint cimport uint8_t, uint32_t, int64_t
 
 ########################
 ### External classes ###
@@ -23,6 +23,10 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix":
         uint8_t brightness()
         FrameCanvas *CreateFrameCanvas()
         FrameCanvas *SwapOnVSync(FrameCanvas*, uint8_t)
+        FrameCanvas *CreateMailbox(int)
+        FrameCanvas *SwapLatest(FrameCanvas*)
+        FrameCanvas *CreateFrameQueue(int)
+        FrameCanvas *QueueFrame(FrameCanvas*, int64_t)
 
     cdef cppclass FrameCanvas(Canvas):
         bool SetPWMBits(uint8_t)
@@ -37,6 +41,11 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix":
       int drop_privileges
       const char *drop_priv_user
       const char *drop_priv_group
+      const char *sleep_jitter_file
+      int refresh_cpu
+      int refresh_priority
+      const char *refresh_policy
+      const char *pixel_mapping_cache
 
 
     RGBMatrix *CreateMatrixFromOptions(Options &options, RuntimeOptions runtime_options)
@@ -65,6 +74,10 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix::RGBMatrix":
         bool disable_hardware_pulsing
         bool show_refresh_rate
         bool inverse_colors
+        bool pulse_brightness
+        bool display_list
+        bool phase_timing
+        bool sched_deadline
 
         const char *led_rgb_sequence
         const char *pixel_mapper_config
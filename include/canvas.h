@@ -18,6 +18,8 @@
 #include <stdint.h>
 
 namespace rgb_matrix {
+struct Color;
+
 // An interface for things a Canvas can do. The RGBMatrix implements this
 // interface, so you can use it directly wherever a canvas is needed.
 //
@@ -41,6 +43,18 @@ public:
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue) = 0;
 
+  // Set the rectangle of width x height pixels starting at (x,y) to
+  // "colors", given row by row. Pixels outside the canvas are ignored.
+  // The default calls SetPixel() for each pixel; implementations override
+  // this if they can do better.
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const Color *colors);
+
+  // Fill the rectangle of width x height pixels starting at (x,y) with the
+  // given color. Like SetPixels(), the default goes pixel by pixel.
+  virtual void SubFill(int x, int y, int width, int height,
+                       uint8_t red, uint8_t green, uint8_t blue);
+
   // Clear screen to be all black.
   virtual void Clear() = 0;
 
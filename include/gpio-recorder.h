@@ -0,0 +1,91 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Instead of the GPIO hardware, the matrix can write to a GPIORecorder. Set
+// RuntimeOptions::gpio_recorder and the refresh runs as usual, but every
+// register write goes to the recorder, on any machine and without root.
+//
+// Writes are stamped with a virtual time: each register write takes a fixed
+// number of nanoseconds, and output-enable pulses take exactly their
+// configured length. Nothing actually waits, so the refresh runs as fast as
+// the CPU allows, which makes this useful to benchmark the refresh path, to
+// count GPIO operations per frame or to reconstruct what a panel would show.
+
+#ifndef RPI_GPIO_RECORDER_H
+#define RPI_GPIO_RECORDER_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+namespace rgb_matrix {
+class GPIORecorder {
+public:
+  // Each register write advances the virtual time by "write_ns".
+  explicit GPIORecorder(int write_ns = 50);
+  virtual ~GPIORecorder() {}
+
+  // Called by the library for each write to the set or clear register. The
+  // bits in "clear_bits" go low, the bits in "set_bits" high; only one of
+  // them is used per write.
+  void Record(uint64_t clear_bits, uint64_t set_bits) {
+    const int64_t now = time_ns();
+    Write(now, clear_bits, set_bits);
+    time_ns_.store(now + write_ns_, std::memory_order_relaxed);
+  }
+
+  // Called by the library while waiting, e.g. for an output-enable pulse.
+  void Wait(int64_t nanoseconds) {
+    time_ns_.store(time_ns() + nanoseconds, std::memory_order_relaxed);
+  }
+
+  // Current virtual time. Can be read from any thread.
+  int64_t time_ns() const { return time_ns_.load(std::memory_order_relaxed); }
+
+protected:
+  // Handle a write that happened at virtual time "time_ns". Called from the
+  // thread writing to the matrix, usually the refresh thread.
+  virtual void Write(int64_t time_ns,
+                     uint64_t clear_bits, uint64_t set_bits) = 0;
+
+private:
+  const int write_ns_;
+  std::atomic<int64_t> time_ns_;  // Only written by the recording thread.
+};
+
+// Keeps the first "max_events" writes in memory and counts all of them.
+class GPIOTrace : public GPIORecorder {
+public:
+  struct Event {
+    int64_t time_ns;
+    uint64_t clear_bits;
+    uint64_t set_bits;
+  };
+
+  // With "max_events" = 0, writes are only counted.
+  explicit GPIOTrace(size_t max_events, int write_ns = 50);
+
+  // Once full, events() does not change anymore and is safe to read while
+  // the refresh keeps running.
+  bool full() const { return full_.load(std::memory_order_acquire); }
+  const std::vector<Event> &events() const { return events_; }
+
+  // Number of writes so far, including the ones not kept. Can be read from
+  // any thread while the refresh is running.
+  uint64_t writes() const { return writes_.load(std::memory_order_relaxed); }
+
+  // Start over with an empty trace. Not while the refresh is running.
+  void Reset();
+
+protected:
+  void Write(int64_t time_ns, uint64_t clear_bits, uint64_t set_bits) final;
+
+private:
+  const size_t max_events_;
+  std::vector<Event> events_;
+  std::atomic<bool> full_;
+  std::atomic<uint64_t> writes_;  // Only written by the recording thread.
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_GPIO_RECORDER_H
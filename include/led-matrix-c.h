@@ -158,6 +158,27 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* Apply brightness by shortening the on-time of the LEDs instead of
+   * re-mapping pixel colors. Brightness changes then take effect immediately
+   * for everything shown.
+   */
+  bool pulse_brightness;     /* Corresponding flag: --led-pulse-brightness */
+
+  /* Precompile frames passed to SwapOnVSync() into a list of GPIO writes
+   * that the refresh just replays.
+   */
+  bool display_list;         /* Corresponding flag: --led-display-list */
+
+  /* Measure time spent per phase and bitplane when sending rows, printed on
+   * exit.
+   */
+  bool phase_timing;         /* Corresponding flag: --led-phase-timing */
+
+  /* With limit_refresh_rate_hz, let the kernel pace the refresh thread with
+   * SCHED_DEADLINE.
+   */
+  bool sched_deadline;       /* Corresponding flag: --led-sched-deadline */
 };
 
 /**
@@ -200,6 +221,23 @@ struct RGBLedRuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // Record nanosleep() jitter, write it to this file on SIGUSR1.
+  const char *sleep_jitter_file;  // Flag: --led-sleep-jitter-file
+
+  // CPU, priority and policy ("fifo" or "rr") of the refresh thread.
+  // As 0 means 'not set' here, CPU 0 or priority 0 (not realtime) can only
+  // be chosen with the command line flags.
+  int refresh_cpu;              // Flag: --led-refresh-cpu
+  int refresh_priority;         // Flag: --led-refresh-priority
+  const char *refresh_policy;   // Flag: --led-refresh-policy
+
+  // A rgb_matrix::GPIORecorder* to write to instead of the GPIO hardware;
+  // only useful with a recorder implemented in C++ (see gpio-recorder.h).
+  void *gpio_recorder;
+
+  // Directory to keep the composed pixel mapping in between starts.
+  const char *pixel_mapping_cache;  // Flag: --led-pixel-mapping-cache
 };
 
 /**
@@ -359,6 +397,83 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Non-blocking "latest frame wins" alternative to led_matrix_swap_on_vsync().
+ * led_matrix_create_mailbox() sets up a pool of queue_depth (at least 3)
+ * canvases and returns the first one to draw on.
+ * led_matrix_swap_latest() posts the finished canvas to be shown at the next
+ * frame boundary and immediately returns a free canvas to draw the next
+ * frame. Frames replaced by a newer one before being shown are dropped.
+ * With a NULL canvas it only returns a free one, or NULL if none can become
+ * free as nothing posted is waiting to be shown.
+ * Ownership of returned pointers stays with the matrix, don't free().
+ */
+struct LedCanvas *led_matrix_create_mailbox(struct RGBLedMatrix *matrix,
+                                            int queue_depth);
+struct LedCanvas *led_matrix_swap_latest(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas);
+
+/**
+ * Frames with presentation time, for frame-accurate playback.
+ * led_matrix_create_frame_queue() sets up a pool of queue_depth (at least 3)
+ * canvases and returns the first one to draw on.
+ * led_matrix_queue_frame() queues the finished canvas to be shown at the
+ * first refresh at or after present_at_us (CLOCK_MONOTONIC, microseconds) and
+ * returns a free canvas to draw the next frame, waiting if there is none.
+ * Frames need to be queued in order of their time.
+ * led_matrix_get_frame_queue_stats() returns the number of frames shown, how
+ * many of these were late and how many were dropped because a later frame
+ * was already due. Any of the pointers can be NULL.
+ * Ownership of returned canvases stays with the matrix, don't free().
+ */
+struct LedCanvas *led_matrix_create_frame_queue(struct RGBLedMatrix *matrix,
+                                                int queue_depth);
+struct LedCanvas *led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas,
+                                         int64_t present_at_us);
+void led_matrix_get_frame_queue_stats(struct RGBLedMatrix *matrix,
+                                      uint64_t *shown, uint64_t *late,
+                                      uint64_t *dropped);
+
+/**
+ * Statistics of the refresh thread. See RGBMatrix::RefreshStats in
+ * led-matrix.h for details.
+ */
+struct LedRefreshStats {
+  uint64_t frames;                /* Frames refreshed so far. */
+
+  /* Of the last 1024 frames, in microseconds. */
+  uint32_t min_frame_us;
+  uint32_t avg_frame_us;
+  uint32_t p99_frame_us;
+  uint32_t max_frame_us;
+
+  /* Bucket i: frames taking [i*250, (i+1)*250) usec, last: longer ones. */
+  uint64_t frame_time_histogram[64];
+
+  uint32_t last_swap_latency_us;  /* Swap call until frame is switched to */
+  uint32_t max_swap_latency_us;
+  uint64_t frames_held_for_fraction;
+  uint64_t pulse_wait_us;         /* Waiting for output-enable pulses. */
+};
+
+void led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                  struct LedRefreshStats *stats);
+
+/**
+ * Histogram of how much longer than requested nanosleep() took when timing
+ * pulses. See RGBMatrix::SleepJitter in led-matrix.h for details.
+ */
+struct LedSleepJitter {
+  uint32_t allowance_us;       /* Currently subtracted from each sleep. */
+  uint32_t overshoot_us[256];  /* Bucket i: sleeps i usec too long. */
+};
+
+void led_matrix_set_sleep_jitter_recording(struct RGBLedMatrix *matrix,
+                                           int enable);
+void led_matrix_get_sleep_jitter(struct RGBLedMatrix *matrix,
+                                 struct LedSleepJitter *jitter);
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
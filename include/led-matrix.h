@@ -34,6 +34,7 @@
 namespace rgb_matrix {
 class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
+class GPIORecorder;  // See gpio-recorder.h
 struct RuntimeOptions;
 
 // The RGB matrix provides the framebuffer and the facilities to constantly
@@ -159,6 +160,30 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // Apply brightness by shortening the time the LEDs are switched on
+    // instead of re-mapping the pixel colors. Changes with
+    // RGBMatrix::SetBrightness() then show up with the next refresh, also
+    // for content already in a canvas or read from a stream.
+    bool pulse_brightness;       // Flag: --led-pulse-brightness
+
+    // Precompile each frame passed to SwapOnVSync() into a flat list of
+    // GPIO writes, so that the refresh only has to replay it. Costs a bit of
+    // memory and time at swap. Frames changed after the swap are sent the
+    // regular way.
+    bool display_list;           // Flag: --led-display-list
+
+    // Measure the time spent in each phase of sending rows to the matrix
+    // (clocking, waiting for the pulse, row address, strobe, pulse) per
+    // bitplane; see RGBMatrix::GetPhaseTiming(). Printed on exit. Only adds
+    // overhead if enabled.
+    bool phase_timing;           // Flag: --led-phase-timing
+
+    // With limit_refresh_rate_hz, run the refresh thread with the
+    // SCHED_DEADLINE policy, so that the kernel itself wakes it up once per
+    // frame period. Such a thread can't be pinned to a particular core.
+    // Falls back to sleeping until the next frame if not permitted.
+    bool sched_deadline;         // Flag: --led-sched-deadline
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -201,8 +226,12 @@ public:
   virtual int height() const;
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const Color *colors);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SubFill(int x, int y, int width, int height,
+                       uint8_t red, uint8_t green, uint8_t blue);
 
   // -- Double- and Multibuffering.
 
@@ -238,6 +267,135 @@ public:
   // time-correct animations.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // -- "Latest frame wins" mailbox.
+  // A non-blocking alternative to SwapOnVSync() for producers that must not
+  // wait for the refresh, e.g. rendering faster than the refresh rate or
+  // receiving frames from the network.
+  //
+  // CreateMailbox() sets up a pool of "queue_depth" canvases (at least 3:
+  // one shown, one waiting to be shown, one being drawn) and returns the
+  // first one to draw on. Returns NULL if called a second time.
+  //
+  // SwapLatest() posts the finished "frame" and right away returns a free
+  // canvas to draw the next one. At the next frame boundary, the refresh
+  // thread switches to the newest frame posted; frames replaced by a newer
+  // one before being shown are handed back without ever being displayed.
+  // Passing NULL just returns another free canvas, if the queue_depth leaves
+  // one. Otherwise this waits until one is released, if a frame posted
+  // before is still to be shown; if not, it returns NULL right away.
+  //
+  // Only pass canvases obtained from these two functions, and don't mix
+  // this with SwapOnVSync().
+  FrameCanvas *CreateMailbox(int queue_depth = 3);
+  FrameCanvas *SwapLatest(FrameCanvas *frame);
+
+  // -- Frames with presentation time.
+  // For frame-accurate playback, e.g. of animations or video: instead of
+  // sleeping between SwapOnVSync() calls, queue frames with the time they
+  // should show up. The refresh thread switches to each frame at the first
+  // refresh at or after its time.
+  //
+  // CreateFrameQueue() sets up a pool of "queue_depth" canvases (at least
+  // 3) and returns the first one to draw on. Returns NULL if called a second
+  // time.
+  //
+  // QueueFrame() appends the finished "frame" to be shown from
+  // "present_at_us" on, a CLOCK_MONOTONIC time in microseconds
+  // (see clock_gettime()). Frames have to be queued in order of their time.
+  // Returns a free canvas to draw the next frame; if all canvases are queued
+  // or shown, this waits until the refresh thread is done with one. With a
+  // NULL "frame" and nothing queued, it returns NULL instead of waiting.
+  // If several queued frames are due at the same refresh, only the last one
+  // is shown, the others are dropped.
+  //
+  // Only pass canvases obtained from these two functions, and don't mix
+  // this with SwapOnVSync() or the mailbox.
+  FrameCanvas *CreateFrameQueue(int queue_depth = 3);
+  FrameCanvas *QueueFrame(FrameCanvas *frame, int64_t present_at_us);
+
+  struct FrameQueueStats {
+    FrameQueueStats() : shown(0), late(0), dropped(0) {}
+    uint64_t shown;     // Queued frames that were shown.
+    uint64_t late;      // .. of these, shown at least one refresh late.
+    uint64_t dropped;   // Frames never shown, as a later one was already due.
+  };
+  FrameQueueStats GetFrameQueueStats();
+
+  // -- Refresh statistics.
+  // Collected by the refresh thread without taking any locks; useful to
+  // monitor refresh performance programmatically instead of watching
+  // the output of --led-show-refresh.
+  struct RefreshStats {
+    RefreshStats();
+
+    uint64_t frames;             // Frames refreshed so far.
+
+    // Rolling minimum, average, 99th percentile and maximum of the time
+    // of the last kFrameWindow frames in microseconds.
+    static constexpr int kFrameWindow = 1024;
+    uint32_t min_frame_us;
+    uint32_t avg_frame_us;
+    uint32_t p99_frame_us;
+    uint32_t max_frame_us;
+
+    // Histogram of all frame times so far. Bucket i counts frames taking
+    // [i * kHistogramBucketUs, (i+1) * kHistogramBucketUs) microseconds,
+    // the last bucket also everything longer.
+    static constexpr int kHistogramBuckets = 64;
+    static constexpr int kHistogramBucketUs = 250;
+    uint64_t frame_time_histogram[kHistogramBuckets];
+
+    // Time from SwapOnVSync() or SwapLatest() until the refresh thread
+    // switched to the new frame, in microseconds.
+    uint32_t last_swap_latency_us;
+    uint32_t max_swap_latency_us;
+
+    // Refreshes a frame passed to SwapOnVSync() had to wait, as the frame
+    // count was not a multiple of the framerate_fraction yet.
+    uint64_t frames_held_for_fraction;
+
+    // Total time spent waiting for the output-enable pulse of the previous
+    // row to finish before the next row could be latched. Only accumulates
+    // with hardware pulsing; software pulses are synchronous.
+    uint64_t pulse_wait_us;
+  };
+  RefreshStats GetRefreshStats();
+
+  // Time spent sending rows to the matrix, split into phases, for each
+  // bitplane (index 0 is the least significant plane available, the highest
+  // pwm_bits planes are the ones used). All times in nanoseconds, summed up
+  // since start. Only collected with Options::phase_timing.
+  struct PhaseTiming {
+    PhaseTiming();
+    static constexpr int kPlanes = 11;
+    uint64_t rows[kPlanes];            // Rows sent in this plane.
+    uint64_t clock_out_ns[kPlanes];    // Clocking in the column data.
+    uint64_t pulse_wait_ns[kPlanes];   // Waiting for this plane's pulse to
+                                       // finish before the next latch.
+    uint64_t row_address_ns[kPlanes];  // Setting the row address.
+    uint64_t strobe_ns[kPlanes];       // Latching the data.
+    uint64_t pulse_ns[kPlanes];        // Starting the pulse (all of it for
+                                       // software generated pulses).
+  };
+  PhaseTiming GetPhaseTiming();
+
+  // -- Sleep jitter.
+  // How much longer than requested the nanosleep() calls took that time the
+  // output-enable pulses. The pulsers ask for a fixed per-Pi-model allowance
+  // less and busy-wait the rest, so this shows how much that allowance could
+  // be tightened on a given kernel. Shared by all matrices of the process.
+  struct SleepJitter {
+    SleepJitter();
+    static constexpr int kBuckets = 256;
+    uint32_t allowance_us;             // Currently subtracted from each sleep.
+    uint32_t overshoot_us[kBuckets];   // Bucket i: sleeps that took i usec
+                                       // too long; last one: that or more.
+  };
+  // Recording is off by default (unless RuntimeOptions::sleep_jitter_file is
+  // given). Enabling it starts with an empty histogram.
+  void SetSleepJitterRecording(bool enable);
+  SleepJitter GetSleepJitter();
+
   // -- Setting shape and behavior of matrix.
 
   // Apply a pixel mapper. This is used to re-map pixels according to some
@@ -266,7 +424,8 @@ public:
   bool luminance_correct() const;
 
   // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // This will only affect newly set pixels; unless Options::pulse_brightness
+  // is set, in which case the whole display is dimmed right away.
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
@@ -383,11 +542,21 @@ public:
   virtual void SetPixel(int x, int y,
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void SetPixels(int x, int y, int width, int height,
-                         Color *colors);
+                         const Color *colors);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
   virtual void SubFill(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue);
-  
+
+  // Replace the whole content of this canvas with the image in "rgb".
+  // The buffer holds height() rows of width() pixels of three bytes each
+  // (red, green, blue); consecutive rows start "stride" bytes apart, which is
+  // typically 3 * width(). LEDs not reachable through the current pixel
+  // mapping are set to black.
+  //
+  // This is much faster than calling SetPixel() for each pixel, as every
+  // word of the internal representation is assembled just once.
+  void SetFromRGBBuffer(const uint8_t *rgb, int stride);
+
 private:
   friend class RGBMatrix;
 
@@ -440,6 +609,28 @@ struct RuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // If set, record the sleep jitter (see RGBMatrix::GetSleepJitter()) from
+  // the start and write the histogram to this file on every SIGUSR1.
+  const char *sleep_jitter_file;  // Flag: --led-sleep-jitter-file
+
+  // Where and how the refresh thread runs. By default on the highest CPU
+  // isolated with isolcpus= or nohz_full= on the kernel command line, or the
+  // last CPU if none is; other threads started by the library stay off that
+  // CPU.
+  int refresh_cpu;              // -1 = auto. Flag: --led-refresh-cpu
+  int refresh_priority;         // 0 = not realtime. --led-refresh-priority
+  const char *refresh_policy;   // "fifo" or "rr".   --led-refresh-policy
+
+  // If set, the matrix writes to this recorder instead of the GPIO hardware
+  // (see gpio-recorder.h); do_gpio_init is ignored then. Needs to outlive
+  // the matrix.
+  GPIORecorder *gpio_recorder;
+
+  // If set, a directory in which the pixel mapping composed from the
+  // multiplexing and pixel mappers is kept, so that the next start with the
+  // same options loads it instead of applying the mappers again.
+  const char *pixel_mapping_cache;  // Flag: --led-pixel-mapping-cache
 };
 
 // Convenience utility functions to read standard rgb-matrix flags and create
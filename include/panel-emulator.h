@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Emulation of the panels a matrix drives, reconstructed only from the GPIO
+// writes (see gpio-recorder.h): shift registers clocking in the color bits,
+// the latch, the row address lines or row shift registers of the configured
+// --led-row-addr-type, and the output-enable pulses. Each pixel collects the
+// time it is lit, which gives the image a human would see on the panel.
+//
+// The image is in the coordinates the panels are wired in, i.e. what a
+// standard panel with the same number of rows and columns would show; for
+// --led-multiplexing these are the coordinates after the multiplexer
+// rearranged rows and columns. Pixel mappers that only rearrange panels,
+// such as --led-pixel-mapper, are not undone.
+//
+// Use it as RuntimeOptions::gpio_recorder to watch a running matrix, or
+// feed it a recorded GPIOTrace with Replay().
+
+#ifndef RPI_PANEL_EMULATOR_H
+#define RPI_PANEL_EMULATOR_H
+#include <stdint.h>
+
+#include <vector>
+
+#include "gpio-recorder.h"
+#include "led-matrix.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+class PanelEmulator : public GPIORecorder {
+public:
+  // Emulate the panels of a matrix created with "options".
+  explicit PanelEmulator(const RGBMatrix::Options &options,
+                         int write_ns = 50);
+  ~PanelEmulator();
+
+  // Size of the emulated image.
+  int width() const;
+  int height() const;
+
+  // Feed writes recorded earlier, e.g. with GPIOTrace.
+  void Replay(const std::vector<GPIOTrace::Event> &events);
+
+  // Start collecting light from scratch, e.g. once new content is shown.
+  void Reset();
+
+  // Get the image collected since the last Reset() as width() * height()
+  // RGB triplets. Each color is the fraction of the time its row was shown
+  // that the LED was on (0.0 .. 1.0), so it is linear in light output.
+  // Safe to call while the matrix is refreshing.
+  void GetImage(std::vector<float> *rgb) const;
+
+protected:
+  void Write(int64_t time_ns, uint64_t clear_bits, uint64_t set_bits) final;
+
+private:
+  class Impl;
+  Impl *const impl_;
+  mutable Mutex mutex_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_PANEL_EMULATOR_H
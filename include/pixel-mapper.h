@@ -81,6 +81,37 @@ public:
                                   int visible_x, int visible_y,
                                   int *matrix_x, int *matrix_y) const = 0;
 
+  // Batch versions of MapVisibleToMatrix(): map the "count" visible pixels
+  // starting at (visible_x, visible_y) in that row, or the rectangle of
+  // width x height visible pixels starting there, with the results stored
+  // row by row in the matrix_x[] and matrix_y[] arrays.
+  //
+  // The defaults loop over MapVisibleToMatrix(). Override MapVisibleRow()
+  // if the work per pixel can be shared along a row, e.g. for mappers with
+  // expensive math.
+  //
+  // RGBMatrix::ApplyPixelMapper() calls MapVisibleRect() for different
+  // parts of large displays from several threads at once, so these must be
+  // safe to call concurrently; being const, they usually are.
+  virtual void MapVisibleRow(int matrix_width, int matrix_height,
+                             int visible_x, int visible_y, int count,
+                             int *matrix_x, int *matrix_y) const {
+    for (int i = 0; i < count; ++i) {
+      MapVisibleToMatrix(matrix_width, matrix_height,
+                         visible_x + i, visible_y, &matrix_x[i], &matrix_y[i]);
+    }
+  }
+  virtual void MapVisibleRect(int matrix_width, int matrix_height,
+                              int visible_x, int visible_y,
+                              int width, int height,
+                              int *matrix_x, int *matrix_y) const {
+    for (int y = 0; y < height; ++y) {
+      MapVisibleRow(matrix_width, matrix_height,
+                    visible_x, visible_y + y, width,
+                    matrix_x + y * width, matrix_y + y * width);
+    }
+  }
+
   virtual bool MapMatrixToVisible(int matrix_width, int matrix_height,
                                   int matrix_x, int matrix_y,
                                   int *visible_x, int *visible_y) const { return false; };
@@ -40,6 +40,18 @@ public:
   // valid.
   virtual void Start(int realtime_priority = 0, uint32_t cpu_affinity_mask = 0);
 
+  // Same as Start(), but with the given scheduling "policy" (SCHED_FIFO or
+  // SCHED_RR) instead of SCHED_FIFO. With SCHED_OTHER or a
+  // realtime_priority of 0, the thread is not made realtime.
+  // With "avoid_cpus" false, a thread without cpu_affinity_mask keeps the
+  // affinity it inherits, including the avoided CPUs (see below).
+  void StartWithPolicy(int policy, int realtime_priority,
+                       uint32_t cpu_affinity_mask, bool avoid_cpus = true);
+
+  // Bitmask of CPUs that threads started without a cpu_affinity_mask should
+  // stay off, such as the one the matrix is refreshed on.
+  static void SetAvoidedCPUs(uint32_t cpu_mask);
+
   // Override this to do the work.
   //
   // This will be called in a thread once Start() has been called. You typically
@@ -55,10 +67,27 @@ private:
   pthread_t thread_;
 };
 
-// Non-recursive Mutex.
+// Condition variable to be used with Mutex::WaitOn(). Timeouts are measured
+// on the monotonic clock, so they are not thrown off if the time of day is
+// changed, e.g. by NTP.
+class ConditionVariable {
+public:
+  ConditionVariable();
+  ~ConditionVariable() { pthread_cond_destroy(&cond_); }
+  void Signal() { pthread_cond_signal(&cond_); }
+  void Broadcast() { pthread_cond_broadcast(&cond_); }
+
+private:
+  friend class Mutex;
+  pthread_cond_t cond_;
+};
+
+// Non-recursive Mutex. Uses priority inheritance: a realtime thread waiting
+// for the mutex lends its priority to the thread holding it, so that one
+// can't be held up by anything of lower priority than the waiter.
 class Mutex {
 public:
-  Mutex() { pthread_mutex_init(&mutex_, NULL); }
+  Mutex();
   ~Mutex() { pthread_mutex_destroy(&mutex_); }
   void Lock() { pthread_mutex_lock(&mutex_); }
   void Unlock() { pthread_mutex_unlock(&mutex_); }
@@ -66,6 +95,10 @@ public:
   // Wait on condition. If "timeout_ms" is < 0, it waits forever, otherwise
   // until timeout is reached.
   // Returns 'true' if condition is met, 'false', if wait timed out.
+  bool WaitOn(ConditionVariable *cond, long timeout_ms = -1);
+
+  // Same for a plain pthread condition, which measures the timeout on the
+  // clock it was created with (CLOCK_REALTIME unless chosen otherwise).
   bool WaitOn(pthread_cond_t *cond, long timeout_ms = -1);
 
 private:
@@ -226,14 +226,23 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
     return g->device_width;  // Outside canvas border. Bail out early.
   }
 
+  // Runs of same-colored pixels are filled in one go.
   for (int y = 0; y < g->height; ++y) {
     const rowbitmap_t& row = g->bitmap[y];
-    for (int x = 0; x < g->device_width; ++x) {
-      if (row.test(kMaxFontWidth - 1 - x)) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-        c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+    int x = 0;
+    while (x < g->device_width) {
+      const bool lit = row.test(kMaxFontWidth - 1 - x);
+      int run = 1;
+      while (x + run < g->device_width
+             && row.test(kMaxFontWidth - 1 - x - run) == lit) {
+        ++run;
       }
+      const Color *run_color = lit ? &color : bgcolor;
+      if (run_color) {
+        c->SubFill(x_pos + x, y_pos + y, run, 1,
+                   run_color->r, run_color->g, run_color->b);
+      }
+      x += run;
     }
   }
   return g->device_width;
@@ -0,0 +1,52 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_BITPLANE_SPREAD_INTERNAL_H
+#define RPI_BITPLANE_SPREAD_INTERNAL_H
+
+#include <stdint.h>
+
+#include "gpio-bits.h"
+
+namespace rgb_matrix {
+namespace internal {
+// Number of pixels handled in one call of a BitSpreadFunction.
+static const int kSpreadLanes = 16;
+
+// Spread the bits of kSpreadLanes mapped color values into GPIO words, one
+// per bitplane and pixel: if bit b of red[i] is set, r_bit is or-ed into
+// out[b * kSpreadLanes + i]; same for green and blue. Only planes
+// 0..num_planes-1 are touched. Since bits are or-ed in, several pixels
+// sharing a GPIO word can be accumulated with subsequent calls.
+typedef void (*BitSpreadFunction)(const uint16_t *red,
+                                  const uint16_t *green,
+                                  const uint16_t *blue,
+                                  gpio_bits_t r_bit,
+                                  gpio_bits_t g_bit,
+                                  gpio_bits_t b_bit,
+                                  int num_planes,
+                                  gpio_bits_t *out);
+
+struct BitSpreadKernel {
+  const char *name;
+  BitSpreadFunction spread;
+};
+
+// Return the fastest kernel this CPU supports (NEON, AVX2, SSE2 or the
+// plain C++ fallback). Chosen once at first call.
+const BitSpreadKernel &GetBitSpreadKernel();
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_BITPLANE_SPREAD_INTERNAL_H
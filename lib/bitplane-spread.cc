@@ -0,0 +1,197 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Kernels that turn a run of color values into bitplane GPIO words.
+//
+// Each color value is one bit per plane; instead of testing the bits of one
+// pixel after another, we look at the same bit of a whole vector of pixels
+// at once and turn it into an all-ones/all-zeros mask per lane, which then
+// selects the GPIO bit. The vector kernels are only built for the usual
+// 32 bit GPIO words.
+
+#include "bitplane-spread-internal.h"
+
+#if defined(__SSE2__) && !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE)
+#  define RGB_MATRIX_SPREAD_SSE2 1
+#  include <emmintrin.h>
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define RGB_MATRIX_SPREAD_AVX2 1
+#    include <immintrin.h>
+#  endif
+#endif
+
+#if defined(__ARM_NEON) && !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE)
+#  define RGB_MATRIX_SPREAD_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+
+static void SpreadScalar(const uint16_t *red, const uint16_t *green,
+                         const uint16_t *blue,
+                         gpio_bits_t r_bit, gpio_bits_t g_bit,
+                         gpio_bits_t b_bit,
+                         int num_planes, gpio_bits_t *out) {
+  for (int b = 0; b < num_planes; ++b) {
+    for (int i = 0; i < kSpreadLanes; ++i) {
+      out[i] |= (-(gpio_bits_t)((red[i] >> b) & 1) & r_bit)
+        | (-(gpio_bits_t)((green[i] >> b) & 1) & g_bit)
+        | (-(gpio_bits_t)((blue[i] >> b) & 1) & b_bit);
+    }
+    out += kSpreadLanes;
+  }
+}
+
+#if RGB_MATRIX_SPREAD_SSE2
+// Four lanes of 32 bit per register. The values are shifted such that the
+// highest used plane sits in the sign bit; an arithmetic shift then gives
+// the mask, and every plane further down is one left shift away.
+static inline __m128i Widen(const uint16_t *values, int half) {
+  const __m128i v = _mm_loadu_si128((const __m128i*)values);
+  return half == 0
+    ? _mm_unpacklo_epi16(v, _mm_setzero_si128())
+    : _mm_unpackhi_epi16(v, _mm_setzero_si128());
+}
+
+static void SpreadSSE2(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       gpio_bits_t r_bit, gpio_bits_t g_bit,
+                       gpio_bits_t b_bit,
+                       int num_planes, gpio_bits_t *out) {
+  const __m128i rb = _mm_set1_epi32(r_bit);
+  const __m128i gb = _mm_set1_epi32(g_bit);
+  const __m128i bb = _mm_set1_epi32(b_bit);
+  const __m128i top = _mm_cvtsi32_si128(32 - num_planes);
+  for (int i = 0; i < kSpreadLanes; i += 8) {
+    for (int half = 0; half < 2; ++half) {
+      __m128i r = _mm_sll_epi32(Widen(red + i, half), top);
+      __m128i g = _mm_sll_epi32(Widen(green + i, half), top);
+      __m128i b = _mm_sll_epi32(Widen(blue + i, half), top);
+      for (int plane = num_planes - 1; plane >= 0; --plane) {
+        __m128i *const dest
+          = (__m128i*)(out + plane * kSpreadLanes + i + 4 * half);
+        const __m128i bits =
+          _mm_or_si128(_mm_or_si128(
+                         _mm_and_si128(_mm_srai_epi32(r, 31), rb),
+                         _mm_and_si128(_mm_srai_epi32(g, 31), gb)),
+                       _mm_and_si128(_mm_srai_epi32(b, 31), bb));
+        _mm_storeu_si128(dest, _mm_or_si128(_mm_loadu_si128(dest), bits));
+        r = _mm_slli_epi32(r, 1);
+        g = _mm_slli_epi32(g, 1);
+        b = _mm_slli_epi32(b, 1);
+      }
+    }
+  }
+}
+#endif
+
+#if RGB_MATRIX_SPREAD_AVX2
+// Same as SSE2, but eight lanes at once. Compiled for AVX2 regardless of the
+// compiler flags, and only used if the CPU tells us it has it.
+__attribute__((target("avx2")))
+static void SpreadAVX2(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       gpio_bits_t r_bit, gpio_bits_t g_bit,
+                       gpio_bits_t b_bit,
+                       int num_planes, gpio_bits_t *out) {
+  const __m256i rb = _mm256_set1_epi32(r_bit);
+  const __m256i gb = _mm256_set1_epi32(g_bit);
+  const __m256i bb = _mm256_set1_epi32(b_bit);
+  const __m128i top = _mm_cvtsi32_si128(32 - num_planes);
+  for (int i = 0; i < kSpreadLanes; i += 8) {
+#define LOAD_WIDE(v) _mm256_sll_epi32(_mm256_cvtepu16_epi32(                 \
+                       _mm_loadu_si128((const __m128i*)((v) + i))), top)
+    __m256i r = LOAD_WIDE(red);
+    __m256i g = LOAD_WIDE(green);
+    __m256i b = LOAD_WIDE(blue);
+#undef LOAD_WIDE
+    for (int plane = num_planes - 1; plane >= 0; --plane) {
+      __m256i *const dest = (__m256i*)(out + plane * kSpreadLanes + i);
+      const __m256i bits =
+        _mm256_or_si256(_mm256_or_si256(
+                          _mm256_and_si256(_mm256_srai_epi32(r, 31), rb),
+                          _mm256_and_si256(_mm256_srai_epi32(g, 31), gb)),
+                        _mm256_and_si256(_mm256_srai_epi32(b, 31), bb));
+      _mm256_storeu_si256(dest,
+                          _mm256_or_si256(_mm256_loadu_si256(dest), bits));
+      r = _mm256_slli_epi32(r, 1);
+      g = _mm256_slli_epi32(g, 1);
+      b = _mm256_slli_epi32(b, 1);
+    }
+  }
+}
+#endif
+
+#if RGB_MATRIX_SPREAD_NEON
+// NEON has a test-bits instruction that directly gives us the lane masks.
+static void SpreadNEON(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue,
+                       gpio_bits_t r_bit, gpio_bits_t g_bit,
+                       gpio_bits_t b_bit,
+                       int num_planes, gpio_bits_t *out) {
+  const uint32x4_t rb = vdupq_n_u32(r_bit);
+  const uint32x4_t gb = vdupq_n_u32(g_bit);
+  const uint32x4_t bb = vdupq_n_u32(b_bit);
+  for (int i = 0; i < kSpreadLanes; i += 8) {
+    const uint16x8_t r16 = vld1q_u16(red + i);
+    const uint16x8_t g16 = vld1q_u16(green + i);
+    const uint16x8_t b16 = vld1q_u16(blue + i);
+    const uint32x4_t r[2] = { vmovl_u16(vget_low_u16(r16)),
+                              vmovl_u16(vget_high_u16(r16)) };
+    const uint32x4_t g[2] = { vmovl_u16(vget_low_u16(g16)),
+                              vmovl_u16(vget_high_u16(g16)) };
+    const uint32x4_t b[2] = { vmovl_u16(vget_low_u16(b16)),
+                              vmovl_u16(vget_high_u16(b16)) };
+    for (int plane = 0; plane < num_planes; ++plane) {
+      const uint32x4_t plane_bit = vdupq_n_u32(1u << plane);
+      for (int h = 0; h < 2; ++h) {
+        uint32_t *const dest = out + plane * kSpreadLanes + i + 4 * h;
+        uint32x4_t bits = vandq_u32(vtstq_u32(r[h], plane_bit), rb);
+        bits = vorrq_u32(bits, vandq_u32(vtstq_u32(g[h], plane_bit), gb));
+        bits = vorrq_u32(bits, vandq_u32(vtstq_u32(b[h], plane_bit), bb));
+        vst1q_u32(dest, vorrq_u32(vld1q_u32(dest), bits));
+      }
+    }
+  }
+}
+#endif
+
+static BitSpreadKernel ChooseKernel() {
+#if RGB_MATRIX_SPREAD_NEON
+  const BitSpreadKernel neon = { "neon", &SpreadNEON };
+  return neon;
+#endif
+#if RGB_MATRIX_SPREAD_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    const BitSpreadKernel avx2 = { "avx2", &SpreadAVX2 };
+    return avx2;
+  }
+#endif
+#if RGB_MATRIX_SPREAD_SSE2
+  const BitSpreadKernel sse2 = { "sse2", &SpreadSSE2 };
+  return sse2;
+#endif
+  const BitSpreadKernel scalar = { "scalar", &SpreadScalar };
+  return scalar;
+}
+
+const BitSpreadKernel &GetBitSpreadKernel() {
+  static const BitSpreadKernel kernel = ChooseKernel();
+  return kernel;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -18,6 +18,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
 
@@ -27,20 +31,34 @@ class PinPulser;
 namespace internal {
 class RowAddressSetter;
 
-// An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
-struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0u){}
-  long gpio_word;
+// The gpio bits that light the red, green and blue LED of a pixel.
+struct PixelColorBits {
   gpio_bits_t r_bit;
   gpio_bits_t g_bit;
   gpio_bits_t b_bit;
-  gpio_bits_t mask;
+  gpio_bits_t mask;  // All bits except these three.
+};
+
+// The color bits of a matrix. All pixels of the same parallel chain and
+// sub-panel share them, so PixelDesignators only keep an index.
+struct PixelColorTable {
+  enum { kEntries = 6 * 2 };  // Parallel chain * 2 + sub-panel.
+  PixelColorBits fill;        // All bits per color; used for Fill().
+  PixelColorBits bits[kEntries];
+};
+
+// An opaque type used within the framebuffer that can be used
+// to copy between PixelMappers. There is one per visible pixel, so it is
+// kept to 8 bytes to let the mapping of large displays stay in the cache.
+struct PixelDesignator {
+  PixelDesignator() : gpio_word(-1), color_bits(0) {}
+  int32_t gpio_word;    // Offset in the bitplane buffer; -1: unused pixel.
+  uint32_t color_bits;  // Index into PixelColorTable::bits.
 };
 
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  PixelDesignatorMap(int width, int height, const PixelColorTable &colors);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
@@ -50,14 +68,109 @@ public:
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
+  // The color bits the PixelDesignators refer to.
+  const PixelColorTable &GetColorTable() const { return colors_; }
+  const PixelColorBits &color_bits(const PixelDesignator &d) const {
+    return colors_.bits[d.color_bits];
+  }
+
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const PixelColorBits &GetFillColorBits() const { return colors_.fill; }
+
+  // Reverse lookup from each gpio word of a bitplane to the visible pixels
+  // that contribute bits to it. Only needed for whole-frame updates, so it is
+  // built by the Framebuffer on first use and then owned by this map.
+  // All canvases share the map and can be drawn from different threads, so
+  // it is built under word_index_once().
+  struct WordSource {
+    int x, y;
+    gpio_bits_t r_bit;
+    gpio_bits_t g_bit;
+    gpio_bits_t b_bit;
+  };
+  struct WordIndex {
+    // Sources of word w are sources[first_source[w] .. first_source[w+1]).
+    std::vector<int> first_source;
+    std::vector<WordSource> sources;
+    std::vector<gpio_bits_t> covered_bits;  // Per word: bits of all sources.
+    // Per word: same number of sources with the same bits as the word left
+    // of it, so runs of such words can be converted in one go.
+    std::vector<char> same_layout;
+  };
+  WordIndex *word_index() { return word_index_; }
+  void set_word_index(WordIndex *index);
+  std::once_flag &word_index_once() { return word_index_once_; }
+
+  // Runs of visible pixels in a row that share their color bits and map to
+  // neighboring gpio words of one panel row, left to right or right to left.
+  // Even after pixel mappers most of a row consists of a few such runs, and
+  // drawing a run is a pointer walk instead of a lookup per pixel. Like the
+  // WordIndex, built by the Framebuffer on first use, under
+  // span_index_once(), and owned by this map.
+  struct Span {
+    int x;                // First visible x of the run.
+    int length;
+    int32_t gpio_word;    // Of the pixel at x; -1 for a run of unused pixels.
+    int step;             // Gpio words from one visible pixel to the next.
+    uint32_t color_bits;  // Index into PixelColorTable::bits.
+  };
+  struct SpanIndex {
+    // Spans of row y are spans[first_span[y] .. first_span[y+1]).
+    std::vector<int> first_span;
+    std::vector<Span> spans;
+  };
+  SpanIndex *span_index() { return span_index_; }
+  void set_span_index(SpanIndex *index);
+  std::once_flag &span_index_once() { return span_index_once_; }
 
 private:
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
+  const PixelColorTable colors_;
   PixelDesignator *const buffer_;
+  WordIndex *word_index_;
+  SpanIndex *span_index_;
+  std::once_flag word_index_once_;
+  std::once_flag span_index_once_;
+};
+
+// The hardware a matrix is connected to: named pin mapping, the way rows are
+// addressed and the pulser for output-enable. Each RGBMatrix owns one and
+// hands it to all its Framebuffers, so several matrices with different
+// wiring can be driven from one process.
+class MatrixHardware {
+public:
+  MatrixHardware();
+  ~MatrixHardware();
+
+  // Initialize GPIO bits for output. Only call once.
+  void InitHardwareMapping(const char *named_hardware);
+  void InitGPIO(GPIO *io, int rows, int parallel,
+                bool allow_hardware_pulsing,
+                int pwm_lsb_nanoseconds,
+                int dither_bits,
+                int row_address_type);
+  void InitializePanels(GPIO *io, const char *panel_type, int columns);
+
+  // The pin mapping chosen with InitHardwareMapping().
+  const struct HardwareMapping &mapping() const { return *hardware_mapping_; }
+
+  // Scale the on-time of all bitplanes to "percent" (1..100) of the timing
+  // given to InitGPIO(). Dims the whole output without touching any pixels.
+  // Only to be called from the thread calling Framebuffer::DumpToMatrix().
+  void SetOutputEnableScale(uint8_t percent);
+
+  // Time spent so far waiting for output-enable pulses to finish, in
+  // microseconds. Only to be called from the thread calling
+  // Framebuffer::DumpToMatrix().
+  uint64_t OutputEnableWaitMicroseconds() const;
+
+private:
+  friend class Framebuffer;
+
+  const struct HardwareMapping *hardware_mapping_;
+  RowAddressSetter *row_setter_;
+  PinPulser *output_enable_pulser_;
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -84,21 +197,14 @@ public:
   static constexpr int kBitPlanes = 11;
   static constexpr int kDefaultBitPlanes = 11;
 
-  Framebuffer(int rows, int columns, int parallel,
+  // The "hardware" needs to have its mapping initialized; it is not owned.
+  Framebuffer(MatrixHardware *hardware,
+              int rows, int columns, int parallel,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
               PixelDesignatorMap **mapper);
   ~Framebuffer();
 
-  // Initialize GPIO bits for output. Only call once.
-  static void InitHardwareMapping(const char *named_hardware);
-  static void InitGPIO(GPIO *io, int rows, int parallel,
-                       bool allow_hardware_pulsing,
-                       int pwm_lsb_nanoseconds,
-                       int dither_bits,
-                       int row_address_type);
-  static void InitializePanels(GPIO *io, const char *panel_type, int columns);
-
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
@@ -116,7 +222,34 @@ public:
   }
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  // Time spent in the phases of sending rows to the matrix, per bitplane,
+  // in GetTickCounter() ticks.
+  struct DumpPhaseTiming {
+    enum Phase {
+      kClockOut,     // Clocking in the column data.
+      kPulseWait,    // Waiting for the pulse of the previous plane to end.
+      kRowAddress,   // Setting the row address.
+      kStrobe,       // Latching the clocked in data.
+      kPulse,        // Starting the pulse (all of it if not asynchronous).
+      kNumPhases
+    };
+    DumpPhaseTiming();
+    uint64_t rows[kBitPlanes];  // Number of rows sent in each plane.
+    uint64_t ticks[kNumPhases][kBitPlanes];
+    int last_pulsed_plane;      // kPulseWait is accounted to this plane.
+  };
+
+  // Send the frame to the matrix.
+  // If "timing" is given, the time spent in each phase is added to it.
+  void DumpToMatrix(GPIO *io, int pwm_bits_to_show,
+                    DumpPhaseTiming *timing = NULL);
+
+  // Precompute the GPIO writes DumpToMatrix() needs into a flat display
+  // list, which is then replayed instead of walking the bitplanes. Any change
+  // to the frame drops the list again until the next call.
+  // Called by the thread drawing the frame; a refresh thread that shows this
+  // frame at the same time keeps using its previous list or the bitplanes.
+  void CompileDisplayList();
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
@@ -127,14 +260,23 @@ public:
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
-  void SetPixels(int x, int y, int width, int height, Color *colors);
+  void SetPixels(int x, int y, int width, int height, const Color *colors);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
   void SubFill(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue);
 
+  // Replace the whole frame with the "rgb" image of width() x height() pixels
+  // with rows "stride" bytes apart. Each gpio word is assembled from all the
+  // pixels sharing it and written once, without read-modify-write.
+  void SetFromRGBBuffer(const uint8_t *rgb, int stride);
+
+  // If "designator" refers to a gpio word of this framebuffer and to one of
+  // the PixelColorTable entries. Used to check mappings read from outside.
+  bool IsValid(const PixelDesignator &designator) const;
+
 private:
-  static const struct HardwareMapping *hardware_mapping_;
-  static RowAddressSetter *row_setter_;
+  MatrixHardware *const hardware_;
+  const struct HardwareMapping *const hardware_mapping_;
 
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case "led_sequence" is _not_ "RGB"
@@ -143,10 +285,52 @@ private:
                                             gpio_bits_t default_g,
                                             gpio_bits_t default_b);
 
-  void InitDefaultDesignator(int x, int y, const char *led_sequence,
-                             PixelDesignator *designator);
+  // Color bits of "r", "g" and "b" pins in the given "led_sequence".
+  static PixelColorBits GetColorBits(const char *led_sequence,
+                                     gpio_bits_t r, gpio_bits_t g,
+                                     gpio_bits_t b);
+
+  void InitDefaultDesignator(int x, int y, PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+
+  // Bitplanes that are written for the current pwm bits.
+  uint32_t WrittenPlanes() const {
+    return ((1u << kBitPlanes) - 1) & ~((1u << (kBitPlanes - pwm_bits_)) - 1);
+  }
+  // Written bitplanes in which a pixel of this mapped color has an LED on.
+  inline uint32_t LitPlanes(uint16_t red, uint16_t green, uint16_t blue) const;
+
+  // Recalculate lit_planes_ from the content of the bitplane buffer.
+  void RecalculateLitPlanes();
+
+  // The double row shown at the given position of the scan.
+  inline int ScanOrderRow(int row_loop) const;
+
+  // The end of the run of dark planes starting at the dark "plane".
+  static inline int DarkPlanesEnd(uint32_t lit_planes, int plane);
+
+  // Sending the rows, with or without measuring the phases in "timing".
+  template <bool kTimed>
+  void DumpRows(GPIO *io, int start_bit, DumpPhaseTiming *timing);
+
+  // DumpToMatrix() for a valid display list.
+  struct DisplayList;
+  template <bool kTimed>
+  void DumpDisplayList(const DisplayList &list, GPIO *io, int start_bit,
+                       DumpPhaseTiming *timing);
+
+  // Get the reverse word index of the current mapping, building it if needed.
+  const PixelDesignatorMap::WordIndex &GetWordIndex();
+  void BuildWordIndex(PixelDesignatorMap *map);
+
+  // Get the span index of the current mapping, building it if needed, and
+  // the spans of row "y" that touch x .. x_end-1.
+  const PixelDesignatorMap::SpanIndex &GetSpanIndex();
+  void BuildSpanIndex(PixelDesignatorMap *map);
+  void FindSpans(int y, int x, int x_end,
+                 const PixelDesignatorMap::Span **begin,
+                 const PixelDesignatorMap::Span **end);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -161,6 +345,7 @@ private:
 
   const int double_rows_;
   const size_t buffer_size_;
+  gpio_bits_t color_clk_mask_;  // Mask of bits while clocking in.
 
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
@@ -171,6 +356,43 @@ private:
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // Per double row a bit for each bitplane that might have an LED on; planes
+  // with their bit cleared are known to be dark and are not sent out at all,
+  // they only keep their time slot with the output switched off.
+  // Writing pixels only ever sets bits, the whole-frame operations such as
+  // Clear(), Fill() or Deserialize() recalculate them.
+  uint32_t *lit_planes_;
+  static_assert(kBitPlanes <= 32, "lit_planes_ needs one bit per plane");
+
+  // Output of CompileDisplayList(): for each lit bitplane of a row and each
+  // run of dark ones a segment, and for each lit segment the (clear, set)
+  // bits of all columns.
+  struct DisplayListSegment {
+    int row;
+    int plane;       // First plane.
+    int end_plane;   // One past the last plane.
+    bool lit;        // If not, the planes only take their time in the dark.
+  };
+  struct DisplayList {
+    std::vector<DisplayListSegment> segments;
+    std::vector<gpio_bits_t> words;
+  };
+
+  // A compiled list is never changed once it is handed to the refresh
+  // thread: CompileDisplayList() fills a spare one and publishes it in
+  // pending_display_list_, the refresh thread takes it from there into
+  // shown_display_list_, which only it uses, and returns its previous one as
+  // the spare. Writes to the frame only clear display_list_valid_, so the
+  // refresh thread goes back to the bitplanes until the next compile.
+  std::atomic<bool> display_list_valid_;
+  std::atomic<DisplayList*> pending_display_list_;
+  std::atomic<DisplayList*> spare_display_list_;
+  DisplayList *shown_display_list_;   // Refresh thread only.
+
+  void InvalidateDisplayList() {
+    display_list_valid_.store(false, std::memory_order_relaxed);
+  }
+
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
 };
 }  // namespace internal
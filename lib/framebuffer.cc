@@ -29,15 +29,12 @@
 
 #include <algorithm>
 
+#include "bitplane-spread-internal.h"
 #include "gpio.h"
 #include "../include/graphics.h"
 
 namespace rgb_matrix {
 namespace internal {
-// We need one global instance of a timing correct pulser. There are different
-// implementations depending on the context.
-static PinPulser *sOutputEnablePulser = NULL;
-
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
@@ -51,15 +48,28 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
 }
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
-  : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+                                       const PixelColorTable &colors)
+  : width_(width), height_(height), colors_(colors),
+    buffer_(new PixelDesignator[width * height]), word_index_(NULL),
+    span_index_(NULL) {
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
+  delete word_index_;
+  delete span_index_;
   delete [] buffer_;
 }
 
+void PixelDesignatorMap::set_word_index(WordIndex *index) {
+  delete word_index_;
+  word_index_ = index;
+}
+
+void PixelDesignatorMap::set_span_index(SpanIndex *index) {
+  delete span_index_;
+  span_index_ = index;
+}
+
 // Different panel types use different techniques to set the row address.
 // We abstract that away with different implementations of RowAddressSetter
 class RowAddressSetter {
@@ -217,6 +227,16 @@ public:
 
   virtual void SetRowAddress(GPIO *io, int row) {
     if (row == last_row_) return;
+    // The next row in a progressive scan is just one more (inactive) bit
+    // shifted in. The final extra clock below leaves the bit of row 0 in the
+    // register twice, so moving away from row 0 needs a full reload as well.
+    if (last_row_ > 0 && row == last_row_ + 1) {
+      io->ClearBits(clock_);
+      io->SetBits(data_);
+      io->SetBits(clock_);
+      last_row_ = row;
+      return;
+    }
     for (int activate = 0; activate < double_rows_; ++activate) {
       io->ClearBits(clock_);
       if (activate == double_rows_ - 1 - row) {
@@ -254,6 +274,15 @@ public:
   virtual gpio_bits_t need_bits() const { return row_mask_; }
 
   virtual void SetRowAddress(GPIO *io, int row) {
+    if (row == last_row_) return;
+    // Advancing to the next row: shift in one more inactive bit.
+    if (last_row_ >= 0 && row == last_row_ + 1) {
+      io->ClearBits(data_);
+      io->SetBits(clock_);
+      io->ClearBits(clock_);
+      last_row_ = row;
+      return;
+    }
     for (int activate = 0; activate < double_rows_; ++activate) {
       io->ClearBits(clock_);
       if (activate == double_rows_ - 1 - row) {
@@ -318,14 +347,23 @@ private:
 
 }
 
-const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
-RowAddressSetter *Framebuffer::row_setter_ = NULL;
+MatrixHardware::MatrixHardware()
+  : hardware_mapping_(NULL), row_setter_(NULL), output_enable_pulser_(NULL) {
+}
+
+MatrixHardware::~MatrixHardware() {
+  delete output_enable_pulser_;
+  delete row_setter_;
+}
 
-Framebuffer::Framebuffer(int rows, int columns, int parallel,
+Framebuffer::Framebuffer(MatrixHardware *hardware,
+                         int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
                          PixelDesignatorMap **mapper)
-  : rows_(rows),
+  : hardware_(hardware),
+    hardware_mapping_(hardware->hardware_mapping_),
+    rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
@@ -334,6 +372,8 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
     double_rows_(rows / SUB_PANELS_),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
+    display_list_valid_(false), pending_display_list_(NULL),
+    spare_display_list_(NULL), shown_display_list_(NULL),
     shared_mapper_(mapper) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
@@ -347,7 +387,30 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   }
   assert(parallel >= 1 && parallel <= 6);
 
+  const struct HardwareMapping &h = *hardware_mapping_;
+  color_clk_mask_ = h.clock;
+  color_clk_mask_ |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+  if (parallel_ >= 2) {
+    color_clk_mask_ |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+  }
+  if (parallel_ >= 3) {
+    color_clk_mask_ |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  }
+  if (parallel_ >= 4) {
+    color_clk_mask_ |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+  }
+  if (parallel_ >= 5) {
+    color_clk_mask_ |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+  }
+  if (parallel_ >= 6) {
+    color_clk_mask_ |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+  }
+
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  lit_planes_ = new uint32_t[double_rows_];
+  for (int row = 0; row < double_rows_; ++row) {
+    lit_planes_[row] = (1u << kBitPlanes) - 1;
+  }
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -360,19 +423,30 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   if (*shared_mapper_ == NULL) {
     // Gather all the bits for given color for fast Fill()s and use the right
     // bits according to the led sequence
-    const struct HardwareMapping &h = *hardware_mapping_;
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2 | h.p3_r1 | h.p3_r2 | h.p4_r1 | h.p4_r2 | h.p5_r1 | h.p5_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2 | h.p3_g1 | h.p3_g2 | h.p4_g1 | h.p4_g2 | h.p5_g1 | h.p5_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2 | h.p3_b1 | h.p3_b2 | h.p4_b1 | h.p4_b2 | h.p5_b1 | h.p5_b2;
-    PixelDesignator fill_bits;
-    fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
-    fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
-    fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
+    PixelColorTable colors;
+    colors.fill = GetColorBits(led_sequence, r, g, b);
+
+    // The pins of each parallel chain and sub-panel.
+    const gpio_bits_t panel_pins[PixelColorTable::kEntries][3] = {
+      { h.p0_r1, h.p0_g1, h.p0_b1 }, { h.p0_r2, h.p0_g2, h.p0_b2 },
+      { h.p1_r1, h.p1_g1, h.p1_b1 }, { h.p1_r2, h.p1_g2, h.p1_b2 },
+      { h.p2_r1, h.p2_g1, h.p2_b1 }, { h.p2_r2, h.p2_g2, h.p2_b2 },
+      { h.p3_r1, h.p3_g1, h.p3_b1 }, { h.p3_r2, h.p3_g2, h.p3_b2 },
+      { h.p4_r1, h.p4_g1, h.p4_b1 }, { h.p4_r2, h.p4_g2, h.p4_b2 },
+      { h.p5_r1, h.p5_g1, h.p5_b1 }, { h.p5_r2, h.p5_g2, h.p5_b2 },
+    };
+    for (int i = 0; i < PixelColorTable::kEntries; ++i) {
+      colors.bits[i] = GetColorBits(led_sequence, panel_pins[i][0],
+                                    panel_pins[i][1], panel_pins[i][2]);
+    }
 
-    *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
+    *shared_mapper_ = new PixelDesignatorMap(columns_, height_, colors);
     for (int y = 0; y < height_; ++y) {
       for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
+        InitDefaultDesignator(x, y, (*shared_mapper_)->get(x, y));
       }
     }
   }
@@ -382,11 +456,15 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
 
 Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete [] lit_planes_;
+  delete pending_display_list_.load();
+  delete spare_display_list_.load();
+  delete shown_display_list_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
 // {addr={22,23,24,25,15},oe=18,clk=17,strobe=4, p0={11,27,7,8,9,10},...}
-/* static */ void Framebuffer::InitHardwareMapping(const char *named_hardware) {
+void MatrixHardware::InitHardwareMapping(const char *named_hardware) {
   if (named_hardware == NULL || *named_hardware == '\0') {
     named_hardware = "regular";
   }
@@ -429,12 +507,12 @@ Framebuffer::~Framebuffer() {
   hardware_mapping_ = mapping;
 }
 
-/* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
-                                        bool allow_hardware_pulsing,
-                                        int pwm_lsb_nanoseconds,
-                                        int dither_bits,
-                                        int row_address_type) {
-  if (sOutputEnablePulser != NULL)
+void MatrixHardware::InitGPIO(GPIO *io, int rows, int parallel,
+                              bool allow_hardware_pulsing,
+                              int pwm_lsb_nanoseconds,
+                              int dither_bits,
+                              int row_address_type) {
+  if (output_enable_pulser_ != NULL)
     return;  // already initialized.
 
   const struct HardwareMapping &h = *hardware_mapping_;
@@ -498,13 +576,23 @@ Framebuffer::~Framebuffer() {
 
   std::vector<int> bitplane_timings;
   uint32_t timing_ns = pwm_lsb_nanoseconds;
-  for (int b = 0; b < kBitPlanes; ++b) {
+  for (int b = 0; b < Framebuffer::kBitPlanes; ++b) {
     bitplane_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
-  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
-                                          allow_hardware_pulsing,
-                                          bitplane_timings);
+  output_enable_pulser_ = PinPulser::Create(io, h.output_enable,
+                                            allow_hardware_pulsing,
+                                            bitplane_timings);
+}
+
+void MatrixHardware::SetOutputEnableScale(uint8_t percent) {
+  if (output_enable_pulser_ == NULL) return;
+  output_enable_pulser_->SetPulseScale(percent);
+}
+
+uint64_t MatrixHardware::OutputEnableWaitMicroseconds() const {
+  if (output_enable_pulser_ == NULL) return 0;
+  return output_enable_pulser_->pulse_wait_usec();
 }
 
 // NOTE: first version for panel initialization sequence, need to refine
@@ -592,9 +680,8 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
   io->ClearBits(h.strobe);
 }
 
-/*static*/ void Framebuffer::InitializePanels(GPIO *io,
-                                              const char *panel_type,
-                                              int columns) {
+void MatrixHardware::InitializePanels(GPIO *io, const char *panel_type,
+                                      int columns) {
   if (!panel_type || panel_type[0] == '\0') return;
   if (strncasecmp(panel_type, "fm6126", 6) == 0) {
     InitFM6126(io, *hardware_mapping_, columns);
@@ -612,6 +699,7 @@ bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
   pwm_bits_ = value;
+  InvalidateDisplayList();
   return true;
 }
 
@@ -622,12 +710,14 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
 }
 
 void Framebuffer::Clear() {
+  InvalidateDisplayList();
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
     memset(bitplane_buffer_, 0,
            sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    memset(lit_planes_, 0, sizeof(*lit_planes_) * double_rows_);
   }
 }
 
@@ -695,10 +785,38 @@ inline void Framebuffer::MapColors(
   }
 }
 
+inline uint32_t Framebuffer::LitPlanes(uint16_t red, uint16_t green,
+                                       uint16_t blue) const {
+  // With inverse colors, a set bit means 'off'.
+  const uint32_t lit = inverse_color_ ? ~(red & green & blue)
+                                      : (red | green | blue);
+  return lit & WrittenPlanes();
+}
+
+void Framebuffer::RecalculateLitPlanes() {
+  const PixelColorBits &fill = (*shared_mapper_)->GetFillColorBits();
+  const gpio_bits_t dark_bits
+    = inverse_color_ ? (fill.r_bit | fill.g_bit | fill.b_bit) : 0;
+  for (int row = 0; row < double_rows_; ++row) {
+    uint32_t lit = 0;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const gpio_bits_t *bits = ValueAt(row, 0, b);
+      for (int col = 0; col < columns_; ++col) {
+        if (bits[col] != dark_bits) {
+          lit |= 1u << b;
+          break;
+        }
+      }
+    }
+    lit_planes_[row] = lit;
+  }
+}
+
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
+  InvalidateDisplayList();
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  const PixelColorBits &fill = (*shared_mapper_)->GetFillColorBits();
 
   for (int bits = kBitPlanes - pwm_bits_; bits < kBitPlanes; ++bits) {
     uint16_t mask = 1 << bits;
@@ -714,9 +832,17 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
       }
     }
   }
+
+  // Planes below the current pwm bits keep whatever they had.
+  const uint32_t written = WrittenPlanes();
+  const uint32_t lit = LitPlanes(red, green, blue);
+  for (int row = 0; row < double_rows_; ++row) {
+    lit_planes_[row] = (lit_planes_[row] & ~written) | lit;
+  }
 }
 
 void Framebuffer::SubFill(int x, int y, int width, int height, uint8_t r, uint8_t g, uint8_t b) {
+  InvalidateDisplayList();
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
@@ -726,32 +852,37 @@ void Framebuffer::SubFill(int x, int y, int width, int height, uint8_t r, uint8_
   int safe_x = std::max(0, x);
   int safe_x_max = std::min((*shared_mapper_)->width(), x + width);
 
+  const uint32_t lit = LitPlanes(red, green, blue);
+  const long plane_words = columns_ * kBitPlanes;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const PixelColorTable &colors = (*shared_mapper_)->GetColorTable();
+
   for (int row = safe_y; row < safe_y_max; row++)
   {
-    const PixelDesignator* designator = (*shared_mapper_)->get(safe_x, row);
-
-    for (int col = safe_x; col < safe_x_max; col++)
-    {
-      if (designator == NULL) continue;
-      const long pos = designator->gpio_word;
-      if (pos < 0) continue;  // non-used pixel marker.
-
-      gpio_bits_t* bits = bitplane_buffer_ + pos;
-      const int min_bit_plane = kBitPlanes - pwm_bits_;
+    const PixelDesignatorMap::Span *span, *spans_end;
+    FindSpans(row, safe_x, safe_x_max, &span, &spans_end);
+    for (/**/; span != spans_end; ++span) {
+      if (span->gpio_word < 0) continue;  // non-used pixel marker.
+      const int from = std::max(safe_x, span->x);
+      const int count = std::min(safe_x_max, span->x + span->length) - from;
+      const int step = span->step;
+
+      gpio_bits_t* bits = bitplane_buffer_ + span->gpio_word
+        + (from - span->x) * step;
       bits += (columns_ * min_bit_plane);
-      const gpio_bits_t r_bits = designator->r_bit;
-      const gpio_bits_t g_bits = designator->g_bit;
-      const gpio_bits_t b_bits = designator->b_bit;
-      const gpio_bits_t designator_mask = designator->mask;
+      const PixelColorBits &color = colors.bits[span->color_bits];
       for (uint16_t mask = 1 << min_bit_plane; mask != 1 << kBitPlanes; mask <<= 1) {
         gpio_bits_t color_bits = 0;
-        if (red & mask)   color_bits |= r_bits;
-        if (green & mask) color_bits |= g_bits;
-        if (blue & mask)  color_bits |= b_bits;
-        *bits = (*bits & designator_mask) | color_bits;
+        if (red & mask)   color_bits |= color.r_bit;
+        if (green & mask) color_bits |= color.g_bit;
+        if (blue & mask)  color_bits |= color.b_bit;
+        gpio_bits_t *word = bits;
+        for (int i = 0; i < count; ++i, word += step) {
+          *word = (*word & color.mask) | color_bits;
+        }
         bits += columns_;
       }
-      designator++;
+      lit_planes_[span->gpio_word / plane_words] |= lit;
     }
   }
 }
@@ -759,11 +890,24 @@ void Framebuffer::SubFill(int x, int y, int width, int height, uint8_t r, uint8_
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
+bool Framebuffer::IsValid(const PixelDesignator &designator) const {
+  if (designator.color_bits >= (uint32_t)PixelColorTable::kEntries)
+    return false;
+  if (designator.gpio_word == -1)
+    return true;  // Unused pixel.
+  const int row_words = columns_ * kBitPlanes;
+  return (designator.gpio_word >= 0
+          && designator.gpio_word / row_words < double_rows_
+          && designator.gpio_word % row_words < columns_);
+}
+
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  PixelDesignatorMap *const map = *shared_mapper_;
+  const PixelDesignator *designator = map->get(x, y);
   if (designator == NULL) return;
   const long pos = designator->gpio_word;
   if (pos < 0) return;  // non-used pixel marker.
+  InvalidateDisplayList();
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
@@ -771,10 +915,11 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   gpio_bits_t *bits = bitplane_buffer_ + pos;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
-  const gpio_bits_t r_bits = designator->r_bit;
-  const gpio_bits_t g_bits = designator->g_bit;
-  const gpio_bits_t b_bits = designator->b_bit;
-  const gpio_bits_t designator_mask = designator->mask;
+  const PixelColorBits &color = map->color_bits(*designator);
+  const gpio_bits_t r_bits = color.r_bit;
+  const gpio_bits_t g_bits = color.g_bit;
+  const gpio_bits_t b_bits = color.b_bit;
+  const gpio_bits_t designator_mask = color.mask;
   for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
     gpio_bits_t color_bits = 0;
     if (red & mask)   color_bits |= r_bits;
@@ -783,16 +928,260 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
     *bits = (*bits & designator_mask) | color_bits;
     bits += columns_;
   }
+  lit_planes_[pos / (columns_ * kBitPlanes)] |= LitPlanes(red, green, blue);
+}
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const Color *colors) {
+  // The whole frame: a Color is just the three bytes of an rgb pixel.
+  static_assert(sizeof(Color) == 3, "Color must be packed red, green, blue");
+  if (x == 0 && y == 0 && width == (*shared_mapper_)->width()
+      && height == (*shared_mapper_)->height()) {
+    SetFromRGBBuffer(reinterpret_cast<const uint8_t*>(colors), 3 * width);
+    return;
+  }
+  InvalidateDisplayList();
+  const int safe_x = std::max(0, x);
+  const int safe_x_max = std::min((*shared_mapper_)->width(), x + width);
+  const int safe_y = std::max(0, y);
+  const int safe_y_max = std::min((*shared_mapper_)->height(), y + height);
+  const long plane_words = columns_ * kBitPlanes;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const PixelColorTable &color_table = (*shared_mapper_)->GetColorTable();
+
+  for (int row = safe_y; row < safe_y_max; ++row) {
+    const Color *row_colors = colors + (row - y) * width;
+    const PixelDesignatorMap::Span *span, *spans_end;
+    FindSpans(row, safe_x, safe_x_max, &span, &spans_end);
+    for (/**/; span != spans_end; ++span) {
+      if (span->gpio_word < 0) continue;  // non-used pixel marker.
+      const int from = std::max(safe_x, span->x);
+      const int to = std::min(safe_x_max, span->x + span->length);
+      const PixelColorBits &color = color_table.bits[span->color_bits];
+      gpio_bits_t *bits = bitplane_buffer_ + span->gpio_word
+        + (from - span->x) * span->step + columns_ * min_bit_plane;
+      uint32_t lit = 0;
+      for (int col = from; col < to; ++col, bits += span->step) {
+        const Color &c = row_colors[col - x];
+        uint16_t red, green, blue;
+        MapColors(c.r, c.g, c.b, &red, &green, &blue);
+        lit |= LitPlanes(red, green, blue);
+        gpio_bits_t *word = bits;
+        for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
+          gpio_bits_t color_bits = 0;
+          if (red & mask)   color_bits |= color.r_bit;
+          if (green & mask) color_bits |= color.g_bit;
+          if (blue & mask)  color_bits |= color.b_bit;
+          *word = (*word & color.mask) | color_bits;
+          word += columns_;
+        }
+      }
+      lit_planes_[span->gpio_word / plane_words] |= lit;
+    }
+  }
+}
+
+const PixelDesignatorMap::WordIndex &Framebuffer::GetWordIndex() {
+  PixelDesignatorMap *const map = *shared_mapper_;
+  std::call_once(map->word_index_once(), &Framebuffer::BuildWordIndex,
+                 this, map);
+  return *map->word_index();
+}
+
+void Framebuffer::BuildWordIndex(PixelDesignatorMap *map) {
+  typedef PixelDesignatorMap::WordSource WordSource;
+  const int words = double_rows_ * columns_;
+  const long plane_words = columns_ * kBitPlanes;
+
+  // Bucket the visible pixels by the word they land in. If a mapper points
+  // more than one visible pixel to the same LED, the last one wins, just as
+  // it would with SetPixel() in row-major order.
+  std::vector<std::vector<WordSource> > buckets(words);
+  for (int y = 0; y < map->height(); ++y) {
+    for (int x = 0; x < map->width(); ++x) {
+      const PixelDesignator *d = map->get(x, y);
+      if (d->gpio_word < 0) continue;  // non-used pixel marker.
+      const PixelColorBits &color = map->color_bits(*d);
+      const gpio_bits_t bits = color.r_bit | color.g_bit | color.b_bit;
+      if (bits == 0) continue;
+      const int word = (d->gpio_word / plane_words) * columns_
+        + d->gpio_word % plane_words;
+      std::vector<WordSource> &bucket = buckets[word];
+      const WordSource source = { x, y, color.r_bit, color.g_bit,
+                                  color.b_bit };
+      size_t i = 0;
+      while (i < bucket.size()
+             && (bucket[i].r_bit | bucket[i].g_bit | bucket[i].b_bit) != bits)
+        ++i;
+      if (i < bucket.size()) bucket[i] = source; else bucket.push_back(source);
+    }
+  }
+
+  PixelDesignatorMap::WordIndex *index = new PixelDesignatorMap::WordIndex();
+  index->first_source.reserve(words + 1);
+  index->covered_bits.reserve(words);
+  index->same_layout.reserve(words);
+  for (int w = 0; w < words; ++w) {
+    index->first_source.push_back(index->sources.size());
+    gpio_bits_t covered = 0;
+    bool same_layout = (w % columns_ != 0
+                        && buckets[w].size() == buckets[w-1].size());
+    for (size_t i = 0; i < buckets[w].size(); ++i) {
+      const WordSource &source = buckets[w][i];
+      covered |= source.r_bit | source.g_bit | source.b_bit;
+      index->sources.push_back(source);
+      if (same_layout) {
+        const WordSource &left = buckets[w-1][i];
+        same_layout = (source.r_bit == left.r_bit
+                       && source.g_bit == left.g_bit
+                       && source.b_bit == left.b_bit);
+      }
+    }
+    index->covered_bits.push_back(covered);
+    index->same_layout.push_back(same_layout);
+  }
+  index->first_source.push_back(index->sources.size());
+  map->set_word_index(index);
 }
 
-void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+const PixelDesignatorMap::SpanIndex &Framebuffer::GetSpanIndex() {
+  PixelDesignatorMap *const map = *shared_mapper_;
+  std::call_once(map->span_index_once(), &Framebuffer::BuildSpanIndex,
+                 this, map);
+  return *map->span_index();
+}
+
+void Framebuffer::BuildSpanIndex(PixelDesignatorMap *map) {
+  typedef PixelDesignatorMap::Span Span;
+  PixelDesignatorMap::SpanIndex *index = new PixelDesignatorMap::SpanIndex();
+  index->first_span.reserve(map->height() + 1);
+  for (int y = 0; y < map->height(); ++y) {
+    const size_t row_start = index->spans.size();
+    index->first_span.push_back(row_start);
+    for (int x = 0; x < map->width(); ++x) {
+      const PixelDesignator *d = map->get(x, y);
+      const int32_t word = d->gpio_word < 0 ? -1 : d->gpio_word;
+      if (index->spans.size() > row_start) {
+        Span &last = index->spans.back();
+        if (word < 0 && last.gpio_word < 0) {
+          ++last.length;
+          continue;
+        }
+        // Words are column offsets in the first plane of a double row, so
+        // dividing by columns_ tells if they are in the same panel row.
+        const int step = word - (last.gpio_word + (last.length - 1) * last.step);
+        if (word >= 0 && last.gpio_word >= 0
+            && d->color_bits == last.color_bits
+            && word / columns_ == last.gpio_word / columns_
+            && (last.length == 1 ? (step == 1 || step == -1)
+                                 : step == last.step)) {
+          last.step = step;
+          ++last.length;
+          continue;
+        }
+      }
+      const Span span = { x, 1, word, 1, d->color_bits };
+      index->spans.push_back(span);
     }
   }
+  index->first_span.push_back(index->spans.size());
+  map->set_span_index(index);
+}
+
+void Framebuffer::FindSpans(int y, int x, int x_end,
+                            const PixelDesignatorMap::Span **begin,
+                            const PixelDesignatorMap::Span **end) {
+  const PixelDesignatorMap::SpanIndex &index = GetSpanIndex();
+  if (x >= x_end) {
+    *begin = *end = index.spans.data();
+    return;
+  }
+  const PixelDesignatorMap::Span *const row_begin
+    = index.spans.data() + index.first_span[y];
+  const PixelDesignatorMap::Span *const row_end
+    = index.spans.data() + index.first_span[y + 1];
+  // The last span starting at or before x contains it.
+  const PixelDesignatorMap::Span *first = std::upper_bound(
+    row_begin, row_end, x,
+    [](int x, const PixelDesignatorMap::Span &s) { return x < s.x; });
+  if (first != row_begin) --first;
+  const PixelDesignatorMap::Span *last = first;
+  while (last != row_end && last->x < x_end) ++last;
+  *begin = first;
+  *end = last;
 }
+
+void Framebuffer::SetFromRGBBuffer(const uint8_t *rgb, int stride) {
+  InvalidateDisplayList();
+  typedef PixelDesignatorMap::WordSource WordSource;
+  const PixelDesignatorMap::WordIndex &index = GetWordIndex();
+
+  // Bits not covered by any visible pixel are left as Clear() would.
+  const PixelColorBits &fill = (*shared_mapper_)->GetFillColorBits();
+  const gpio_bits_t clear_bits
+    = inverse_color_ ? (fill.r_bit | fill.g_bit | fill.b_bit) : 0;
+
+  // Brightness, luminance correction and inversion are the same for all
+  // pixels, so map each possible channel value just once. Planes below
+  // min_bit_plane are never shown, so they are shifted out right away.
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  uint16_t lookup[256];
+  for (int c = 0; c < 256; ++c) {
+    uint16_t unused_green, unused_blue;
+    MapColors(c, 0, 0, &lookup[c], &unused_green, &unused_blue);
+    lookup[c] >>= min_bit_plane;
+  }
+
+  // Consecutive words that share the same source layout are handed to the
+  // vector kernel, one source slot of up to kSpreadLanes words at a time.
+  const internal::BitSpreadFunction spread
+    = internal::GetBitSpreadKernel().spread;
+  const int lanes = internal::kSpreadLanes;
+  const uint32_t written = WrittenPlanes();
+  for (int row = 0; row < double_rows_; ++row) {
+    uint32_t lit = 0;
+    int col = 0;
+    while (col < columns_) {
+      const int word = row * columns_ + col;
+      int run = 1;
+      while (run < lanes && col + run < columns_
+             && index.same_layout[word + run]) {
+        ++run;
+      }
+
+      gpio_bits_t plane_bits[kBitPlanes * internal::kSpreadLanes] = {0};
+      uint16_t red[internal::kSpreadLanes] = {0};
+      uint16_t green[internal::kSpreadLanes] = {0};
+      uint16_t blue[internal::kSpreadLanes] = {0};
+      const int slots = index.first_source[word+1] - index.first_source[word];
+      for (int slot = 0; slot < slots; ++slot) {
+        for (int i = 0; i < run; ++i) {
+          const WordSource &source
+            = index.sources[index.first_source[word + i] + slot];
+          const uint8_t *pixel = rgb + source.y * stride + source.x * 3;
+          red[i] = lookup[pixel[0]];
+          green[i] = lookup[pixel[1]];
+          blue[i] = lookup[pixel[2]];
+        }
+        const WordSource &first = index.sources[index.first_source[word]+slot];
+        spread(red, green, blue, first.r_bit, first.g_bit, first.b_bit,
+               pwm_bits_, plane_bits);
+      }
+
+      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+        gpio_bits_t *bits = ValueAt(row, col, b);
+        const gpio_bits_t *from = plane_bits + (b - min_bit_plane) * lanes;
+        for (int i = 0; i < run; ++i) {
+          bits[i] = (clear_bits & ~index.covered_bits[word + i]) | from[i];
+          lit |= (uint32_t)(bits[i] != clear_bits) << b;
+        }
+      }
+      col += run;
+    }
+    lit_planes_[row] = (lit_planes_[row] & ~written) | lit;
+  }
+}
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 const char *led_sequence,
@@ -814,81 +1203,23 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
   return default_r;  // String too long, should've been caught earlier.
 }
 
-void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
-                                        PixelDesignator *d) {
-  const struct HardwareMapping &h = *hardware_mapping_;
+PixelColorBits Framebuffer::GetColorBits(const char *seq, gpio_bits_t r,
+                                         gpio_bits_t g, gpio_bits_t b) {
+  PixelColorBits result;
+  result.r_bit = GetGpioFromLedSequence('R', seq, r, g, b);
+  result.g_bit = GetGpioFromLedSequence('G', seq, r, g, b);
+  result.b_bit = GetGpioFromLedSequence('B', seq, r, g, b);
+  result.mask = ~(result.r_bit | result.g_bit | result.b_bit);
+  return result;
+}
+
+void Framebuffer::InitDefaultDesignator(int x, int y, PixelDesignator *d) {
   gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
   d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
-  if (y < rows_) {
-    if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-    }
-  }
-  else if (y >= rows_ && y < 2 * rows_) {
-    if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-    }
-  }
-  else if (y >= 2*rows_ && y < 3 * rows_) {
-    if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-    }
-  }
-  else if (y >= 3*rows_ && y < 4 * rows_) {
-    if (y - 3*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-    }
-  }
-  else if (y >= 4*rows_ && y < 5 * rows_){
-    if (y - 4*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-    }
-
-  }
-  else {
-    if (y - 5*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-    }
-  }
-
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  // Rows beyond the last parallel chain end up on the last one.
+  const int parallel = std::min(y / rows_, PixelColorTable::kEntries / 2 - 1);
+  const int sub_panel = (y - parallel * rows_ < double_rows_) ? 0 : 1;
+  d->color_bits = 2 * parallel + sub_panel;
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
@@ -898,81 +1229,237 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
+  InvalidateDisplayList();
   memcpy(bitplane_buffer_, data, len);
+  RecalculateLitPlanes();
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
+  InvalidateDisplayList();
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  memcpy(lit_planes_, other->lit_planes_, sizeof(*lit_planes_) * double_rows_);
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
-  }
-  if (parallel_ >= 4) {
-    color_clk_mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
-  }
-  if (parallel_ >= 5) {
-    color_clk_mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+inline int Framebuffer::DarkPlanesEnd(uint32_t lit_planes, int plane) {
+  const uint32_t lit_above = lit_planes >> plane;
+  return lit_above ? plane + __builtin_ctz(lit_above) : (int)kBitPlanes;
+}
+
+inline int Framebuffer::ScanOrderRow(int row_loop) const {
+  if (scan_mode_ == 1) {  // interlaced
+    const int half_double = double_rows_/2;
+    return ((row_loop < half_double)
+            ? (row_loop << 1)
+            : ((row_loop - half_double) << 1) + 1);
   }
-  if (parallel_ >= 6) {
-    color_clk_mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+  return row_loop;  // progressive
+}
+
+void Framebuffer::CompileDisplayList() {
+  if (display_list_valid_.load(std::memory_order_relaxed)) return;
+  DisplayList *list = spare_display_list_.exchange(NULL);
+  if (list == NULL) list = new DisplayList();
+  list->segments.clear();
+  list->words.clear();
+  list->segments.reserve(double_rows_ * kBitPlanes);
+  list->words.reserve(2 * double_rows_ * kBitPlanes * columns_);
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    const int d_row = ScanOrderRow(row_loop);
+    const uint32_t lit_planes = lit_planes_[d_row];
+    // Lower planes are kept even if dithering skips them in some frames.
+    for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
+      if ((lit_planes & (1u << b)) == 0) {
+        // A run of dark planes, up to the whole row, only takes its time.
+        const int end = DarkPlanesEnd(lit_planes, b);
+        const DisplayListSegment segment = { d_row, b, end, false };
+        list->segments.push_back(segment);
+        b = end - 1;
+        continue;
+      }
+      const DisplayListSegment segment = { d_row, b, b + 1, true };
+      list->segments.push_back(segment);
+      const gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+      for (int col = 0; col < columns_; ++col) {
+        list->words.push_back(~row_data[col] & color_clk_mask_);
+        list->words.push_back(row_data[col] & color_clk_mask_);
+      }
+    }
   }
+  // An older list that the refresh thread has not picked up yet was never
+  // seen by it, so it can be reused right away.
+  DisplayList *const unused = pending_display_list_.exchange(list);
+  if (unused != NULL) delete spare_display_list_.exchange(unused);
+  display_list_valid_.store(true, std::memory_order_release);
+}
 
-  color_clk_mask |= h.clock;
+Framebuffer::DumpPhaseTiming::DumpPhaseTiming() : last_pulsed_plane(0) {
+  memset(rows, 0, sizeof(rows));
+  memset(ticks, 0, sizeof(ticks));
+}
 
-  // Depending if we do dithering, we might not always show the lowest bits.
-  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
+namespace {
+// Adds the time since the previous Mark() to a phase of a bitplane.
+// Compiles to nothing when not enabled.
+template <bool kEnabled> class PhaseTimer;
 
-  const uint8_t half_double = double_rows_/2;
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
-      break;
+template <> class PhaseTimer<false> {
+public:
+  explicit PhaseTimer(Framebuffer::DumpPhaseTiming *) {}
+  void Mark(Framebuffer::DumpPhaseTiming::Phase, int) {}
+  void CountRow(int) {}
+};
+
+template <> class PhaseTimer<true> {
+public:
+  explicit PhaseTimer(Framebuffer::DumpPhaseTiming *timing)
+    : timing_(timing), last_(GetTickCounter()) {}
+
+  void Mark(Framebuffer::DumpPhaseTiming::Phase phase, int plane) {
+    const uint64_t now = GetTickCounter();
+    timing_->ticks[phase][plane] += now - last_;
+    last_ = now;
+  }
+  void CountRow(int plane) { timing_->rows[plane]++; }
 
-    case 1:  // interlaced
-      d_row = ((row_loop < half_double)
-               ? (row_loop << 1)
-               : ((row_loop - half_double) << 1) + 1);
+private:
+  Framebuffer::DumpPhaseTiming *const timing_;
+  uint64_t last_;
+};
+}  // namespace
+
+template <bool kTimed>
+void Framebuffer::DumpDisplayList(const DisplayList &list, GPIO *io,
+                                  int start_bit, DumpPhaseTiming *timing) {
+  typedef DumpPhaseTiming T;
+  PhaseTimer<kTimed> timer(timing);
+  int last_pulsed_plane = kTimed ? timing->last_pulsed_plane : 0;
+  const gpio_bits_t clock = hardware_mapping_->clock;
+  const gpio_bits_t strobe = hardware_mapping_->strobe;
+  const gpio_bits_t *words = list.words.data();
+  for (size_t i = 0; i < list.segments.size(); ++i) {
+    const DisplayListSegment &segment = list.segments[i];
+    if (!segment.lit) {
+      const int first = std::max(segment.plane, start_bit);
+      if (first >= segment.end_plane) continue;  // Dithering: not this time.
+      hardware_->output_enable_pulser_->WaitPulseFinished();
+      timer.Mark(T::kPulseWait, last_pulsed_plane);
+      hardware_->output_enable_pulser_->SendDarkPulses(first,
+                                                       segment.end_plane);
+      timer.Mark(T::kPulse, first);
+      last_pulsed_plane = first;
+      continue;
+    }
+    if (segment.plane < start_bit) {   // Dithering: not this time.
+      words += 2 * columns_;
+      continue;
+    }
+    for (int col = 0; col < columns_; ++col) {
+      io->WriteClearSetBits(words[0], words[1]);
+      io->SetBits(clock);
+      words += 2;
     }
+    io->ClearBits(color_clk_mask_);
+    timer.Mark(T::kClockOut, segment.plane);
+    hardware_->output_enable_pulser_->WaitPulseFinished();
+    timer.Mark(T::kPulseWait, last_pulsed_plane);
+    hardware_->row_setter_->SetRowAddress(io, segment.row);
+    timer.Mark(T::kRowAddress, segment.plane);
+    io->SetBits(strobe);
+    io->ClearBits(strobe);
+    timer.Mark(T::kStrobe, segment.plane);
+    hardware_->output_enable_pulser_->SendPulse(segment.plane);
+    timer.Mark(T::kPulse, segment.plane);
+    timer.CountRow(segment.plane);
+    last_pulsed_plane = segment.plane;
+  }
+  if (kTimed) timing->last_pulsed_plane = last_pulsed_plane;
+}
+
+template <bool kTimed>
+void Framebuffer::DumpRows(GPIO *io, int start_bit, DumpPhaseTiming *timing) {
+  typedef DumpPhaseTiming T;
+  const struct HardwareMapping &h = *hardware_mapping_;
+  PhaseTimer<kTimed> timer(timing);
+  int last_pulsed_plane = kTimed ? timing->last_pulsed_plane : 0;
+
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    const int d_row = ScanOrderRow(row_loop);
+    const uint32_t lit_planes = lit_planes_[d_row];
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = start_bit; b < kBitPlanes; ++b) {
+      if ((lit_planes & (1u << b)) == 0) {
+        // Nothing to see in this plane and maybe the next ones: no need to
+        // clock them in or switch on. They still take their time in the dark,
+        // so that the share of the frame each row is on for, i.e. the
+        // brightness, does not depend on the content; one wait for the whole
+        // run. A row that is all dark is a single wait and never even gets
+        // its address set.
+        const int end = DarkPlanesEnd(lit_planes, b);
+        hardware_->output_enable_pulser_->WaitPulseFinished();
+        timer.Mark(T::kPulseWait, last_pulsed_plane);
+        hardware_->output_enable_pulser_->SendDarkPulses(b, end);
+        timer.Mark(T::kPulse, b);
+        last_pulsed_plane = b;
+        b = end - 1;
+        continue;
+      }
+
       gpio_bits_t *row_data = ValueAt(d_row, 0, b);
       // While the output enable is still on, we can already clock in the next
       // data.
       for (int col = 0; col < columns_; ++col) {
         const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
+        io->WriteMaskedBits(out, color_clk_mask_);  // col + reset clock
         io->SetBits(h.clock);               // Rising edge: clock color in.
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
+      io->ClearBits(color_clk_mask_);    // clock back to normal.
+      timer.Mark(T::kClockOut, b);
 
       // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
+      hardware_->output_enable_pulser_->WaitPulseFinished();
+      timer.Mark(T::kPulseWait, last_pulsed_plane);
 
       // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
+      hardware_->row_setter_->SetRowAddress(io, d_row);
+      timer.Mark(T::kRowAddress, b);
 
       io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
       io->ClearBits(h.strobe);
+      timer.Mark(T::kStrobe, b);
 
       // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      hardware_->output_enable_pulser_->SendPulse(b);
+      timer.Mark(T::kPulse, b);
+      timer.CountRow(b);
+      last_pulsed_plane = b;
     }
   }
+  if (kTimed) timing->last_pulsed_plane = last_pulsed_plane;
+}
+
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit,
+                               DumpPhaseTiming *timing) {
+  // Depending if we do dithering, we might not always show the lowest bits.
+  const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
+  if (display_list_valid_.load(std::memory_order_acquire)) {
+    // Switch to a newly compiled list; the one shown so far is spare now.
+    // A valid flag means at least one list was published.
+    DisplayList *const compiled = pending_display_list_.exchange(NULL);
+    if (compiled != NULL) {
+      delete spare_display_list_.exchange(shown_display_list_);
+      shown_display_list_ = compiled;
+    }
+    const DisplayList &list = *shown_display_list_;
+    if (timing) DumpDisplayList<true>(list, io, start_bit, timing);
+    else DumpDisplayList<false>(list, io, start_bit, NULL);
+  } else {
+    if (timing) DumpRows<true>(io, start_bit, timing);
+    else DumpRows<false>(io, start_bit, NULL);
+  }
 }
 }  // namespace internal
 }  // namespace rgb_matrix
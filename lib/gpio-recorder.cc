@@ -0,0 +1,45 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-recorder.h"
+
+namespace rgb_matrix {
+GPIORecorder::GPIORecorder(int write_ns) : write_ns_(write_ns), time_ns_(0) {
+}
+
+GPIOTrace::GPIOTrace(size_t max_events, int write_ns)
+  : GPIORecorder(write_ns), max_events_(max_events), full_(false),
+    writes_(0) {
+  events_.reserve(max_events_);
+}
+
+void GPIOTrace::Reset() {
+  events_.clear();
+  full_.store(false);
+  writes_.store(0);
+}
+
+void GPIOTrace::Write(int64_t time_ns,
+                      uint64_t clear_bits, uint64_t set_bits) {
+  writes_.store(writes_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  if (events_.size() >= max_events_) return;
+  const Event event = { time_ns, clear_bits, set_bits };
+  events_.push_back(event);
+  if (events_.size() == max_events_) {
+    full_.store(true, std::memory_order_release);
+  }
+}
+}  // namespace rgb_matrix
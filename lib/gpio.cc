@@ -19,7 +19,9 @@
 #include "gpio.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +29,9 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+
 /*
  * nanosleep() takes longer than requested because of OS jitter.
  * In about 99.9% of the cases, this is <= 25 microcseconds on
@@ -34,7 +39,8 @@
  * we subtract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * You can measure the overhead with the sleep jitter recording below
+ * (RGBMatrix::SetSleepJitterRecording() or --led-sleep-jitter-file).
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
@@ -52,15 +58,6 @@
  */
 #define MINIMUM_NANOSLEEP_TIME_US 5
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
- * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
- */
-#define DEBUG_SLEEP_JITTER 0
-
 // Raspberry 1 and 2 have different base addresses for the periphery
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
@@ -144,7 +141,7 @@ static bool LinuxHasModuleLoaded(const char *name) {
 #define GPIO_BIT(x) (1ull << x)
 
 GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
-               slowdown_(1)
+               slowdown_(1), recorder_(NULL)
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
              , uses_64_bit_(false)
 #endif
@@ -153,6 +150,11 @@ GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
 
 gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
                               bool adafruit_pwm_transition_hack_needed) {
+  if (recorder_) {
+    outputs &= ~(output_bits_ | input_bits_);
+    output_bits_ |= outputs;
+    return outputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -204,6 +206,11 @@ gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
 }
 
 gpio_bits_t GPIO::RequestInputs(gpio_bits_t inputs) {
+  if (recorder_) {
+    inputs &= ~(output_bits_ | input_bits_);
+    input_bits_ |= inputs;
+    return inputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
     return 0;
@@ -425,6 +432,11 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+void GPIO::InitRecording(GPIORecorder *recorder) {
+  recorder_ = recorder;
+  slowdown_ = 0;  // Delays would write to the hardware.
+}
+
 bool GPIO::IsPi4() {
   return GetPiModel() == PI_MODEL_4;
 }
@@ -450,7 +462,7 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), nano_specs_(nano_specs), pulse_specs_(nano_specs) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -460,28 +472,153 @@ public:
 
   virtual void SendPulse(int time_spec_number) {
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    Timers::sleep_nanos(pulse_specs_[time_spec_number]);
     io_->SetBits(bits_);
   }
 
+  virtual void SendDarkPulses(int first, int end) {
+    long nanos = 0;
+    for (int i = first; i < end; ++i) nanos += pulse_specs_[i];
+    Timers::sleep_nanos(nanos);
+  }
+
+  virtual void SetPulseScale(int percent) {
+    for (size_t i = 0; i < nano_specs_.size(); ++i) {
+      pulse_specs_[i] = std::max(1, nano_specs_[i] * percent / 100);
+    }
+  }
+
 private:
   GPIO *const io_;
   const gpio_bits_t bits_;
   const std::vector<int> nano_specs_;
+  std::vector<int> pulse_specs_;   // nano_specs_ scaled by SetPulseScale()
 };
 
-// Check that 3 shows up in isolcpus
-static bool HasIsolCPUs() {
-  char buf[256];
-  ReadTextFileToBuffer(buf, sizeof(buf), "/sys/devices/system/cpu/isolated");
-  return index(buf, '3') != NULL;
+// Parse a list of CPUs such as "1,3" or "2-3" as found in /sys into a mask.
+static uint32_t ParseCPUList(const char *list) {
+  uint32_t mask = 0;
+  const char *pos = list;
+  for (;;) {
+    char *end;
+    const long first = strtol(pos, &end, 10);
+    if (end == pos) break;
+    long last = first;
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos) break;
+    }
+    for (long cpu = std::max(first, 0L); cpu <= last && cpu < 32; ++cpu) {
+      mask |= 1u << cpu;
+    }
+    if (*end != ',') break;
+    pos = end + 1;
+  }
+  return mask;
+}
+
+// Busy waiting. Rather than loop counts tuned per Pi model, which are off as
+// soon as the clock, the compiler or the board is different, we measure how
+// fast our loop is at startup and keep checking every now and then.
+// Any thread may busy wait: the first wait calibrates, the calibration is
+// shared through atomics, and each thread keeps its own recheck samples.
+static void BusyLoop(uint32_t loops) __attribute__((noinline));
+static void BusyLoop(uint32_t loops) {
+  for (uint32_t i = loops; i != 0; --i) {
+    asm("");
+  }
+}
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Loops per nanosecond in 16.16 fixed point and the fixed cost of a busy
+// wait in nanoseconds. Zero rate means not calibrated yet.
+// Shared by all threads busy waiting, e.g. the refresh threads of several
+// matrices, so each value is read and written as a whole.
+static std::atomic<uint32_t> s_busy_loops_per_ns_q16(0);
+static std::atomic<long> s_busy_overhead_ns(0);
+static std::atomic<int64_t> s_clock_read_ns(0);  // Cost of the two clock reads.
+
+// Shortest of a few runs: anything longer was disturbed by something else.
+// Includes the cost of reading the clock.
+static int64_t MeasureBusyLoopNanos(uint32_t loops, bool call_loop = true) {
+  int64_t best = -1;
+  for (int i = 0; i < 5; ++i) {
+    const int64_t start = MonotonicNanos();
+    if (call_loop) BusyLoop(loops);
+    const int64_t elapsed = MonotonicNanos() - start;
+    if (best < 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+static void CalibrateBusyWait() {
+  const int64_t clock_read_ns = MeasureBusyLoopNanos(0, false);
+  const int64_t overhead_ns = std::max(MeasureBusyLoopNanos(0) - clock_read_ns,
+                                       (int64_t)0);
+  // Grow the loop count until it takes about a millisecond; this also gives
+  // the CPU frequency governor a chance to ramp up.
+  uint32_t loops = 1 << 12;
+  int64_t loop_ns;
+  while ((loop_ns = MeasureBusyLoopNanos(loops)) < 1000000
+         && loops < (1u << 30)) {
+    loops *= 2;
+  }
+  loop_ns -= clock_read_ns + overhead_ns;
+  s_clock_read_ns = clock_read_ns;
+  s_busy_overhead_ns = overhead_ns;
+  s_busy_loops_per_ns_q16 = std::max(((uint64_t)loops << 16)
+                                     / std::max(loop_ns, (int64_t)1),
+                                     (uint64_t)1);
+}
+
+// Every kBusyWaitRecheckInterval-th longer wait is timed. The median rate of
+// a few of these replaces the calibrated one, so we follow clock changes
+// without being thrown off by the occasional preemption.
+static const uint32_t kBusyWaitRecheckInterval = 4096;
+static const long kBusyWaitRecheckMinNanos = 20000;
+static const int kBusyWaitRecheckSamples = 8;
+
+// Samples are collected per thread, only the resulting rate is shared.
+static thread_local uint32_t t_busy_wait_samples[kBusyWaitRecheckSamples];
+static thread_local int t_busy_wait_sample_count = 0;
+static thread_local uint32_t t_long_busy_waits = 0;
+
+static void RecheckBusyWait(uint32_t loops) {
+  uint32_t *const samples = t_busy_wait_samples;
+  int &sample_count = t_busy_wait_sample_count;
+  const int64_t start = MonotonicNanos();
+  BusyLoop(loops);
+  const int64_t elapsed = MonotonicNanos() - start
+    - s_clock_read_ns - s_busy_overhead_ns;
+  if (elapsed <= 0) return;
+  samples[sample_count++] = ((uint64_t)loops << 16) / elapsed;
+  if (sample_count < kBusyWaitRecheckSamples) return;
+  sample_count = 0;
+  std::sort(samples, samples + kBusyWaitRecheckSamples);
+  const uint64_t median = ((uint64_t)samples[kBusyWaitRecheckSamples/2 - 1]
+                           + samples[kBusyWaitRecheckSamples/2]) / 2;
+  s_busy_loops_per_ns_q16 = std::max(median, (uint64_t)1);
 }
 
-static void busy_wait_nanos_rpi_1(long nanos);
-static void busy_wait_nanos_rpi_2(long nanos);
-static void busy_wait_nanos_rpi_3(long nanos);
-static void busy_wait_nanos_rpi_4(long nanos);
-static void (*busy_wait_impl)(long) = busy_wait_nanos_rpi_3;
+static void busy_wait_nanos(long nanos) {
+  if (s_busy_loops_per_ns_q16 == 0) CalibrateBusyWait();
+  const long overhead_ns = s_busy_overhead_ns;
+  if (nanos <= overhead_ns) return;
+  const uint32_t loops =
+    ((uint64_t)(nanos - overhead_ns) * s_busy_loops_per_ns_q16) >> 16;
+  if (nanos >= kBusyWaitRecheckMinNanos
+      && ++t_long_busy_waits % kBusyWaitRecheckInterval == 0) {
+    RecheckBusyWait(loops);
+  } else {
+    BusyLoop(loops);
+  }
+}
 
 // Best effort write to file. Used to set kernel parameters.
 static void WriteTo(const char *filename, const char *str) {
@@ -508,23 +645,8 @@ bool Timers::Init() {
   if (!mmap_all_bcm_registers_once())
     return false;
 
-  // Choose the busy-wait loop that fits our Pi.
-  switch (GetPiModel()) {
-  case PI_MODEL_1: busy_wait_impl = busy_wait_nanos_rpi_1; break;
-  case PI_MODEL_2: busy_wait_impl = busy_wait_nanos_rpi_2; break;
-  case PI_MODEL_3: busy_wait_impl = busy_wait_nanos_rpi_3; break;
-  case PI_MODEL_4: busy_wait_impl = busy_wait_nanos_rpi_4; break;
-  }
-
   DisableRealtimeThrottling();
-  // If we have it, we run the update thread on core3. No perf-compromises:
-  WriteTo("/sys/devices/system/cpu/cpu3/cpufreq/scaling_governor",
-          "performance");
-
-  if (GetPiModel() != PI_MODEL_1 && !HasIsolCPUs()) {
-    fprintf(stderr, "Suggestion: to slightly improve display update, add\n\tisolcpus=3\n"
-            "at the end of /boot/cmdline.txt and reboot (see README.md)\n");
-  }
+  CalibrateBusyWait();
   return true;
 }
 
@@ -544,6 +666,81 @@ static uint32_t JitterAllowanceMicroseconds() {
   return EMPIRICAL_NANOSLEEP_OVERHEAD_US;
 }
 
+// Time subtracted from each nanosleep() to leave room for its overshoot.
+static uint32_t SleepAllowanceMicroseconds() {
+  return s_Timer1Mhz ? JitterAllowanceMicroseconds()
+                     : EMPIRICAL_NANOSLEEP_OVERHEAD_US;
+}
+
+// Histogram of how much longer than requested nanosleep() took. Written by
+// the refresh thread, read by anyone including the signal handler below, so
+// only lock-free atomics here.
+static std::atomic<bool> s_record_sleep_jitter(false);
+static std::atomic<uint32_t> s_sleep_jitter_us[kSleepJitterBuckets];
+static const char *s_sleep_jitter_file = NULL;
+static uint32_t s_sleep_jitter_allowance_us = 0;  // For the signal handler.
+
+static void RecordSleepJitter(long requested_us, long slept_us) {
+  long overshoot = slept_us - requested_us;
+  if (overshoot < 0) overshoot = 0;
+  if (overshoot >= kSleepJitterBuckets) overshoot = kSleepJitterBuckets - 1;
+  s_sleep_jitter_us[overshoot].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Called in signal context: no stdio, just write(2) with our own formatting.
+static char *AppendNumber(char *out, uint64_t value, int min_digits) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0 || n < min_digits);
+  while (n > 0) *out++ = digits[--n];
+  return out;
+}
+
+static void WriteSleepJitterFile(int) {
+  const int saved_errno = errno;
+  const int fd = open(s_sleep_jitter_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    errno = saved_errno;
+    return;
+  }
+  uint32_t histogram[kSleepJitterBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kSleepJitterBuckets; ++i) {
+    histogram[i] = s_sleep_jitter_us[i].load(std::memory_order_relaxed);
+    total += histogram[i];
+  }
+  char line[80];
+  char *pos = line;
+  static const char kHeader[] = "# nanosleep() overshoot, allowance ";
+  memcpy(pos, kHeader, sizeof(kHeader) - 1);
+  pos = AppendNumber(pos + sizeof(kHeader) - 1,
+                     s_sleep_jitter_allowance_us, 1);
+  static const char kColumns[] = "us\n# usec count accum%\n";
+  memcpy(pos, kColumns, sizeof(kColumns) - 1);
+  pos += sizeof(kColumns) - 1;
+  bool ok = write(fd, line, pos - line) == pos - line;
+  uint64_t running = 0;
+  for (int us = 0; ok && us < kSleepJitterBuckets; ++us) {
+    if (histogram[us] == 0) continue;
+    running += histogram[us];
+    const uint64_t accum = running * 100000 / total;  // 1/1000 percent.
+    pos = AppendNumber(line, us, 1);
+    *pos++ = ' ';
+    pos = AppendNumber(pos, histogram[us], 1);
+    *pos++ = ' ';
+    pos = AppendNumber(pos, accum / 1000, 1);
+    *pos++ = '.';
+    pos = AppendNumber(pos, accum % 1000, 3);
+    *pos++ = '\n';
+    ok = write(fd, line, pos - line) == pos - line;
+  }
+  close(fd);
+  errno = saved_errno;
+}
+
 void Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
@@ -562,6 +759,9 @@ void Timers::sleep_nanos(long nanos) {
       struct timespec sleep_time = { 0, nanos - kJitterAllowanceNanos };
       nanosleep(&sleep_time, NULL);
       const uint32_t after = *s_Timer1Mhz;
+      if (s_record_sleep_jitter.load(std::memory_order_relaxed)) {
+        RecordSleepJitter(sleep_time.tv_nsec / 1000, after - before);
+      }
       const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
       if (nanoseconds_passed > nanos) {
         return;  // darn, missed it.
@@ -575,67 +775,62 @@ void Timers::sleep_nanos(long nanos) {
     if (nanos > (EMPIRICAL_NANOSLEEP_OVERHEAD_US + MINIMUM_NANOSLEEP_TIME_US)*1000) {
       struct timespec sleep_time
         = { 0, nanos - EMPIRICAL_NANOSLEEP_OVERHEAD_US*1000 };
-      nanosleep(&sleep_time, NULL);
+      if (s_record_sleep_jitter.load(std::memory_order_relaxed)) {
+        const uint32_t before = GetMicrosecondCounter();
+        nanosleep(&sleep_time, NULL);
+        RecordSleepJitter(sleep_time.tv_nsec / 1000,
+                          GetMicrosecondCounter() - before);
+      } else {
+        nanosleep(&sleep_time, NULL);
+      }
       return;
     }
   }
 
-  busy_wait_impl(nanos);  // Use model-specific busy-loop for remaining time.
+  busy_wait_nanos(nanos);  // Use calibrated busy-loop for remaining time.
 }
 
-static void busy_wait_nanos_rpi_1(long nanos) {
-  if (nanos < 70) return;
-  // The following loop is determined empirically on a 700Mhz RPi
-  for (uint32_t i = (nanos - 70) >> 2; i != 0; --i) {
-    asm("nop");
-  }
-}
-
-static void busy_wait_nanos_rpi_2(long nanos) {
-  if (nanos < 20) return;
-  // The following loop is determined empirically on a 900Mhz RPi 2
-  for (uint32_t i = (nanos - 20) * 100 / 110; i != 0; --i) {
-    asm("");
+// Pulses of a recording GPIO: they take no time, but the recorder is told
+// how long they would have taken.
+class RecordingPinPulser : public PinPulser {
+public:
+  RecordingPinPulser(GPIO *io, gpio_bits_t bits,
+                     const std::vector<int> &nano_specs)
+    : io_(io), bits_(bits), nano_specs_(nano_specs), pulse_specs_(nano_specs) {
   }
-}
 
-static void busy_wait_nanos_rpi_3(long nanos) {
-  if (nanos < 20) return;
-  for (uint32_t i = (nanos - 15) * 100 / 73; i != 0; --i) {
-    asm("");
+  virtual void SendPulse(int time_spec_number) {
+    io_->ClearBits(bits_);
+    io_->recorder()->Wait(pulse_specs_[time_spec_number]);
+    io_->SetBits(bits_);
   }
-}
 
-static void busy_wait_nanos_rpi_4(long nanos) {
-  if (nanos < 20) return;
-  // Interesting, the Pi4 is _slower_ than the Pi3 ? At least for this busy loop
-  for (uint32_t i = (nanos - 5) * 100 / 132; i != 0; --i) {
-    asm("");
+  virtual void SendDarkPulses(int first, int end) {
+    int64_t nanos = 0;
+    for (int i = first; i < end; ++i) nanos += pulse_specs_[i];
+    io_->recorder()->Wait(nanos);
   }
-}
 
-#if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
-static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
-          "%6s | %7s | %7s\n",
-          JitterAllowanceMicroseconds(), "usec", "count", "accum");
-  int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
-  int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
-    const int count = overshoot_histogram_us[us];
-    if (count > 0) {
-      running_count += count;
-      fprintf(stderr, "%s%3dus: %8d %7.3f%%\n", (us == 0) ? "<=" : " +",
-              us, count, 100.0 * running_count / total_count);
+  virtual void SetPulseScale(int percent) {
+    for (size_t i = 0; i < nano_specs_.size(); ++i) {
+      pulse_specs_[i] = std::max(1, nano_specs_[i] * percent / 100);
     }
   }
-}
-#endif
+
+private:
+  GPIO *const io_;
+  const gpio_bits_t bits_;
+  const std::vector<int> nano_specs_;
+  std::vector<int> pulse_specs_;
+};
 
 // A PinPulser that uses the PWM hardware to create accurate pulses.
-// It only works on GPIO-12 or 18 though.
+// It only works on GPIO-12 or 18 though. There is only one PWM channel we can
+// use, so only one at a time can exist. PinPulser::Create() claims it before
+// constructing one, so matrices created from several threads can't both get
+// it; the destructor gives it back.
+static std::atomic<bool> s_hardware_pulser_in_use(false);
+
 class HardwarePinPulser : public PinPulser {
 public:
   static bool CanHandle(gpio_bits_t gpio_mask) {
@@ -662,14 +857,10 @@ public:
   }
 
   HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : triggered_(false), pulse_wait_usec_(0) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
-#if DEBUG_SLEEP_JITTER
-    atexit(print_overshoot_histogram);
-#endif
-
     if (LinuxHasModuleLoaded("snd_bcm2835")) {
       fprintf(stderr,
               "\n%s=== snd_bcm2835: found that the Pi sound module is loaded. ===%s\n"
@@ -683,11 +874,6 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_us_.push_back(specs[i]/1000 - JitterAllowanceMicroseconds());
-    }
-
     const int base = specs[0];
     // Get relevant registers
     fifo_ = s_PWM_registers + PWM_FIFO;
@@ -701,59 +887,59 @@ public:
     } else {
       assert(false); // should've been caught by CanHandle()
     }
-    InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
+    base_divider_ = (base/2) / PWM_BASE_TIME_NS;
     for (size_t i = 0; i < specs.size(); ++i) {
       pwm_range_.push_back(2 * specs[i] / base);
     }
+    sleep_hints_us_.resize(pwm_range_.size());
+    SetPulseScale(100);
   }
 
-  virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c];
+  virtual ~HardwarePinPulser() {
+    s_hardware_pulser_in_use.store(false);
+  }
 
-      *fifo_ = pwm_range_[c];
-    } else {
-      // Keep the actual range as short as possible, as we have to
-      // wait for one full period of these in the zero phase.
-      // The hardware can't deal with values < 2, so only do this when
-      // have enough of these.
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
+  // Dimming is done by speeding up the PWM clock with a smaller divider, so
+  // all pulses get shorter but keep their exact binary relation. The ranges
+  // are never shortened: the lowest plane already is at the smallest range
+  // the hardware handles, so there would be nothing to keep the relation
+  // with. This limits dimming to kMinPWMDivider / base_divider_, about 6% at
+  // the default --led-pwm-lsb-nanoseconds=130; lower percentages stay there.
+  virtual void SetPulseScale(int percent) {
+    WaitPulseFinished();
+    const uint32_t wanted = base_divider_ * percent;  // in 1/100 divider.
+    const uint32_t divider = std::max((wanted + 50) / 100, kMinPWMDivider);
+    for (size_t i = 0; i < pwm_range_.size(); ++i) {
+      // Hints how long to nanosleep, already corrected for system overhead.
+      const int pulse_ns = pwm_range_[i] * divider * PWM_BASE_TIME_NS;
+      sleep_hints_us_[i] = pulse_ns/1000 - JitterAllowanceMicroseconds();
     }
+    InitPWMDivider(divider);
+    divider_ = divider;
+  }
 
-    /*
-     * We need one value at the end to have it go back to
-     * default state (otherwise it just repeats the last
-     * value, so will be constantly 'on').
-     */
-    *fifo_ = 0;   // sentinel.
-
-    /*
-     * For some reason, we need a second empty sentinel in the
-     * fifo, otherwise our way to detect the end of the pulse,
-     * which relies on 'is the queue empty' does not work. It is
-     * not entirely clear why that is from the datasheet,
-     * but probably there is some buffering register in which data
-     * elements are kept after the fifo is emptied.
-     */
-    *fifo_ = 0;
+  virtual void SendPulse(int c) {
+    StartPulse(pwm_range_[c], true, sleep_hints_us_[c]);
+  }
 
-    sleep_hint_us_ = sleep_hints_us_[c];
-    start_time_ = *s_Timer1Mhz;
-    triggered_ = true;
-    s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
+  // Every value in the fifo takes one full range period, so with all of
+  // them zero the output stays off for exactly as long. A run of planes is
+  // one pulse of their summed range; that only drops the remainder of the
+  // division into eight fifo values, a few PWM clocks.
+  virtual void SendDarkPulses(int first, int end) {
+    if (end - first == 1) {
+      StartPulse(pwm_range_[first], false, sleep_hints_us_[first]);
+      return;
+    }
+    uint32_t range = 0;
+    for (int i = first; i < end; ++i) range += pwm_range_[i];
+    const int pulse_ns = range * divider_ * PWM_BASE_TIME_NS;
+    StartPulse(range, false, pulse_ns/1000 - JitterAllowanceMicroseconds());
   }
 
   virtual void WaitPulseFinished() {
     if (!triggered_) return;
+    const uint32_t wait_start = *s_Timer1Mhz;
     // Determine how long we already spent and sleep to get close to the
     // actual end-time of our sleep period.
     //
@@ -768,18 +954,10 @@ public:
         struct timespec sleep_time = { 0, 1000 * to_sleep_us };
         nanosleep(&sleep_time, NULL);
 
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *s_Timer1Mhz - start_time_;
-          const int nanoslept_us = total_us - already_elapsed_usec;
-          int overshoot = nanoslept_us - (to_sleep_us + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
+        if (s_record_sleep_jitter.load(std::memory_order_relaxed)) {
+          RecordSleepJitter(to_sleep_us, (uint32_t)(*s_Timer1Mhz - start_time_)
+                            - already_elapsed_usec);
         }
-#endif
       }
     }
 
@@ -788,9 +966,58 @@ public:
     }
     s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_POLA1 | PWM_CTL_CLRF1;
     triggered_ = false;
+    pulse_wait_usec_ += *s_Timer1Mhz - wait_start;
   }
 
+  virtual uint64_t pulse_wait_usec() const { return pulse_wait_usec_; }
+
 private:
+  void StartPulse(uint32_t range, bool lit, int sleep_hint_us) {
+    if (range < 16) {
+      s_PWM_registers[PWM_RNG1] = range;
+
+      *fifo_ = lit ? range : 0;
+    } else {
+      // Keep the actual range as short as possible, as we have to
+      // wait for one full period of these in the zero phase.
+      // The hardware can't deal with values < 2, so only do this when
+      // have enough of these.
+      const uint32_t value = lit ? range / 8 : 0;
+      s_PWM_registers[PWM_RNG1] = range / 8;
+
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+      *fifo_ = value;
+    }
+
+    /*
+     * We need one value at the end to have it go back to
+     * default state (otherwise it just repeats the last
+     * value, so will be constantly 'on').
+     */
+    *fifo_ = 0;   // sentinel.
+
+    /*
+     * For some reason, we need a second empty sentinel in the
+     * fifo, otherwise our way to detect the end of the pulse,
+     * which relies on 'is the queue empty' does not work. It is
+     * not entirely clear why that is from the datasheet,
+     * but probably there is some buffering register in which data
+     * elements are kept after the fifo is emptied.
+     */
+    *fifo_ = 0;
+
+    sleep_hint_us_ = sleep_hint_us;
+    start_time_ = *s_Timer1Mhz;
+    triggered_ = true;
+    s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
+  }
+
   void SetGPIOMode(volatile uint32_t *gpioReg, unsigned gpio, unsigned mode) {
     const int reg = gpio / 10;
     const int mode_pos = (gpio % 10) * 3;
@@ -818,26 +1045,38 @@ private:
   }
 
 private:
-  std::vector<uint32_t> pwm_range_;
+  static const uint32_t kMinPWMDivider = 2;
+
+  uint32_t base_divider_;              // PWM clock divider at full length.
+  uint32_t divider_;                   // Current PWM clock divider.
+  std::vector<uint32_t> pwm_range_;    // Pulse ranges, in PWM clocks.
   std::vector<int> sleep_hints_us_;
   volatile uint32_t *fifo_;
   uint32_t start_time_;
   int sleep_hint_us_;
   bool triggered_;
+  uint64_t pulse_wait_usec_;
 };
 
+const uint32_t HardwarePinPulser::kMinPWMDivider;  // Used by std::max().
+
 } // end anonymous namespace
 
 // Public PinPulser factory
 PinPulser *PinPulser::Create(GPIO *io, gpio_bits_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
+  if (io->recorder() != NULL)
+    return new RecordingPinPulser(io, gpio_mask, nano_wait_spec);
   if (!Timers::Init()) return NULL;
   if (allow_hardware_pulsing && HardwarePinPulser::CanHandle(gpio_mask)) {
-    return new HardwarePinPulser(gpio_mask, nano_wait_spec);
-  } else {
-    return new TimerBasedPinPulser(io, gpio_mask, nano_wait_spec);
+    bool expected = false;
+    if (s_hardware_pulser_in_use.compare_exchange_strong(expected, true))
+      return new HardwarePinPulser(gpio_mask, nano_wait_spec);
+    fprintf(stderr, "Hardware pulse generator already used by another "
+            "matrix; falling back to timed pulses.\n");
   }
+  return new TimerBasedPinPulser(io, gpio_mask, nano_wait_spec);
 }
 
 // For external use, e.g. in the matrix for extra time.
@@ -858,4 +1097,114 @@ void SleepMicroseconds(long t) {
   Timers::sleep_nanos(t * 1000);
 }
 
+void SleepUntilMonotonicNanos(int64_t deadline_ns, bool busy_finish) {
+  const int64_t wake_ns = busy_finish
+    ? deadline_ns - 1000 * (int64_t)SleepAllowanceMicroseconds()
+    : deadline_ns;
+  if (MonotonicNanos() < wake_ns) {
+    const struct timespec wake = { (time_t)(wake_ns / 1000000000),
+                                   (long)(wake_ns % 1000000000) };
+    // Not recorded as sleep jitter: that histogram is about the sleeps
+    // within pulses, which the allowance is tuned for.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+           == EINTR) {
+    }
+  }
+  if (busy_finish) {
+    while (MonotonicNanos() < deadline_ns) {
+      // We have our dedicated core, so ok to burn the last few cycles.
+    }
+  }
+}
+
+void SetSleepJitterRecording(bool enable) {
+  if (enable && !s_record_sleep_jitter.load()) {
+    for (int i = 0; i < kSleepJitterBuckets; ++i) s_sleep_jitter_us[i] = 0;
+  }
+  s_record_sleep_jitter.store(enable);
+}
+
+uint32_t GetSleepJitterHistogram(uint32_t histogram[kSleepJitterBuckets]) {
+  for (int i = 0; i < kSleepJitterBuckets; ++i) {
+    histogram[i] = s_sleep_jitter_us[i].load(std::memory_order_relaxed);
+  }
+  return SleepAllowanceMicroseconds();
+}
+
+bool WriteSleepJitterOnSignal(const char *filename) {
+  s_sleep_jitter_file = strdup(filename);
+  s_sleep_jitter_allowance_us = SleepAllowanceMicroseconds();
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &WriteSleepJitterFile;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGUSR1, &sa, NULL) != 0) {
+    perror("sigaction(SIGUSR1)");
+    return false;
+  }
+  SetSleepJitterRecording(true);
+  return true;
+}
+
+uint32_t GetIsolatedCPUs() {
+  char buf[256];
+  uint32_t mask = 0;
+  if (ReadTextFileToBuffer(buf, sizeof(buf),
+                           "/sys/devices/system/cpu/isolated") > 0) {
+    mask |= ParseCPUList(buf);
+  }
+  if (ReadTextFileToBuffer(buf, sizeof(buf),
+                           "/sys/devices/system/cpu/nohz_full") > 0) {
+    mask |= ParseCPUList(buf);
+  }
+  return mask;
+}
+
+int DefaultRefreshCPU(uint32_t busy_cpus) {
+  const long cpus = std::min(sysconf(_SC_NPROCESSORS_ONLN), 32L);
+  if (cpus <= 1) return -1;
+  const uint32_t online = (1ull << cpus) - 1;
+  const uint32_t isolated = GetIsolatedCPUs() & online;
+  const uint32_t free_isolated = isolated & ~busy_cpus;
+  if (free_isolated != 0) return 31 - __builtin_clz(free_isolated);
+  const uint32_t free_cpus = online & ~busy_cpus & ~1u;
+  if (free_cpus != 0) return 31 - __builtin_clz(free_cpus);
+  if (isolated != 0) return 31 - __builtin_clz(isolated);
+  return cpus - 1;
+}
+
+void PrepareRefreshCPU(int cpu) {
+  // No perf-compromises on the core the refresh runs on.
+  char governor[128];
+  snprintf(governor, sizeof(governor),
+           "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+  WriteTo(governor, "performance");
+
+  if ((GetIsolatedCPUs() & (1u << cpu)) == 0) {
+    fprintf(stderr, "Suggestion: to slightly improve display update, add\n"
+            "\tisolcpus=%d\n"
+            "at the end of /boot/cmdline.txt and reboot (see README.md)\n",
+            cpu);
+  }
+}
+
+static uint64_t MeasureTickCounterFrequency() {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  const uint64_t start_ticks = GetTickCounter();
+  const struct timespec sleep_time = { 0, 20 * 1000000 };
+  nanosleep(&sleep_time, NULL);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  const uint64_t ticks = GetTickCounter() - start_ticks;
+  const int64_t nanos = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000
+    + (end.tv_nsec - start.tv_nsec);
+  return nanos > 0 ? ticks * 1000000000 / nanos : 1000000000;
+}
+
+uint64_t GetTickCounterFrequency() {
+  static const uint64_t frequency = MeasureTickCounterFrequency();
+  return frequency;
+}
+
 } // namespace rgb_matrix
@@ -17,9 +17,16 @@
 #define RPI_GPIO_INTERNAL_H
 
 #include "gpio-bits.h"
+#include "gpio-recorder.h"
+
+#include <time.h>
 
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
 #if __ARM_ARCH >= 7
 #define LED_MATRIX_ALLOW_BARRIER_DELAY 1
 #else
@@ -38,6 +45,13 @@ public:
   // (e.g. due to a permission problem).
   bool Init(int slowdown);
 
+  // Initialize to send all writes to "recorder" instead of the hardware.
+  // All outputs are available, inputs always read as zero.
+  void InitRecording(GPIORecorder *recorder);
+
+  // The recorder given to InitRecording(), NULL if writing to the hardware.
+  GPIORecorder *recorder() const { return recorder_; }
+
   // Initialize outputs.
   // Returns the bits that were available and could be set for output.
   // (never use the optional adafruit_hack_needed parameter, it is used
@@ -72,7 +86,18 @@ public:
     delay();
   }
 
-  inline gpio_bits_t Read() const { return ReadRegisters() & input_bits_; }
+  // Same as WriteMaskedBits(), but with the bits to clear and to set already
+  // worked out, i.e. (~value & mask) and (value & mask).
+  inline void WriteClearSetBits(gpio_bits_t clear_bits, gpio_bits_t set_bits) {
+    WriteClrBits(clear_bits);
+    WriteSetBits(set_bits);
+    delay();
+  }
+
+  inline gpio_bits_t Read() const {
+    if (recorder_) return 0;
+    return ReadRegisters() & input_bits_;
+  }
 
   // Return if this is appears to be a Pi4
   static bool IsPi4();
@@ -99,6 +124,10 @@ private:
   }
 
   inline void WriteSetBits(gpio_bits_t value) {
+    if (__builtin_expect(recorder_ != NULL, 0)) {
+      recorder_->Record(0, value);
+      return;
+    }
     *gpio_set_bits_low_ = static_cast<uint32_t>(value & 0xFFFFFFFF);
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
     if (uses_64_bit_)
@@ -107,6 +136,10 @@ private:
   }
 
   inline void WriteClrBits(gpio_bits_t value) {
+    if (__builtin_expect(recorder_ != NULL, 0)) {
+      recorder_->Record(value, 0);
+      return;
+    }
     *gpio_clr_bits_low_ = static_cast<uint32_t>(value & 0xFFFFFFFF);
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
     if (uses_64_bit_)
@@ -119,6 +152,7 @@ private:
   gpio_bits_t input_bits_;
   gpio_bits_t reserved_bits_;
   int slowdown_;
+  GPIORecorder *recorder_;
 
   volatile uint32_t *gpio_set_bits_low_;
   volatile uint32_t *gpio_clr_bits_low_;
@@ -151,8 +185,21 @@ public:
   // Send a pulse with a given length (index into nano_wait_spec array).
   virtual void SendPulse(int time_spec_number) = 0;
 
+  // Take as long as SendPulse() would for the time specs "first" up to
+  // "end" - 1 together, but leave the output off. Keeps the timing of
+  // bitplanes that have nothing to show, in one go for a run of them.
+  virtual void SendDarkPulses(int first, int end) = 0;
+
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Total time spent waiting in WaitPulseFinished() in microseconds.
+  // Only call from the thread sending the pulses.
+  virtual uint64_t pulse_wait_usec() const { return 0; }
+
+  // Scale all pulses to "percent" (1..100) of the length given in
+  // nano_wait_spec. Only call from the thread sending the pulses.
+  virtual void SetPulseScale(int percent) = 0;
 };
 
 // Get rolling over microsecond counter. We get this from a hardware register
@@ -161,6 +208,62 @@ uint32_t GetMicrosecondCounter();
 
 void SleepMicroseconds(long);
 
+// CPUs set aside with isolcpus= or nohz_full= on the kernel command line, as
+// bitmask.
+uint32_t GetIsolatedCPUs();
+
+// CPU best suited to run the refresh thread on: the highest isolated one if
+// there is any, the last CPU otherwise. -1 if there is only one CPU.
+// CPUs in "busy_cpus" already run a refresh thread and are only chosen if
+// there is nothing else left besides CPU 0.
+int DefaultRefreshCPU(uint32_t busy_cpus = 0);
+
+// Run "cpu" at full speed and suggest to isolate it if it isn't yet.
+void PrepareRefreshCPU(int cpu);
+
+// Sleep until CLOCK_MONOTONIC reaches "deadline_ns". If "busy_finish", wake
+// up a bit early and busy-wait the rest to be accurate.
+void SleepUntilMonotonicNanos(int64_t deadline_ns, bool busy_finish);
+
+// Recording how many microseconds nanosleep() took longer than requested
+// in the pin pulsers and SleepMicroseconds(). Off by default; enabling it
+// starts from an empty histogram.
+static const int kSleepJitterBuckets = 256;
+void SetSleepJitterRecording(bool enable);
+
+// Copy the histogram: bucket i counts sleeps that overshot by i microseconds,
+// the last bucket by that or more. Returns the allowance in microseconds that
+// is currently subtracted from each sleep to absorb the overshoot.
+uint32_t GetSleepJitterHistogram(uint32_t histogram[kSleepJitterBuckets]);
+
+// Start recording and write the histogram to "filename" whenever the process
+// receives SIGUSR1.
+bool WriteSleepJitterOnSignal(const char *filename);
+
+// Fine grained counter for timing measurements: the ARM generic timer or the
+// x86 time stamp counter if we have them, nanoseconds otherwise. Ticks per
+// second are given by GetTickCounterFrequency().
+inline uint64_t GetTickCounter() {
+#if defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#elif defined(__arm__) && __ARM_ARCH >= 7
+  uint64_t ticks;
+  asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
+  return ticks;
+#elif defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Ticks per second of GetTickCounter(). Measured once at first call.
+uint64_t GetTickCounterFrequency();
+
 }  // end namespace rgb_matrix
 
 #endif  // RPI_GPIO_INGERNALH
@@ -19,8 +19,27 @@
 #include <stdlib.h>
 #include <functional>
 #include <algorithm>
+#include <vector>
 
 namespace rgb_matrix {
+void Canvas::SetPixels(int x, int y, int width, int height,
+                       const Color *colors) {
+  for (int row = 0; row < height; ++row) {
+    for (int col = 0; col < width; ++col, ++colors) {
+      SetPixel(x + col, y + row, colors->r, colors->g, colors->b);
+    }
+  }
+}
+
+void Canvas::SubFill(int x, int y, int width, int height,
+                     uint8_t red, uint8_t green, uint8_t blue) {
+  for (int row = 0; row < height; ++row) {
+    for (int col = 0; col < width; ++col) {
+      SetPixel(x + col, y + row, red, green, blue);
+    }
+  }
+}
+
 bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
               const uint8_t *buffer, size_t size,
               const int width, const int height,
@@ -53,25 +72,49 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
     ? (canvas_offset_x + image_display_w - w) * 3
     : 0;
 
-  // Let's make this a combined skip per row and adjust where we start.
-  const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
-
-  if (is_bgr) {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[2], buffer[1], buffer[0]);
-        buffer += 3;
-      }
-      buffer += next_row_skip;
+  const size_t row_bytes = 3 * width;
+
+  const int rect_w = std::max(0, w - canvas_offset_x);
+  const int rect_h = std::max(0, h - canvas_offset_y);
+  if (rect_w == 0 || rect_h == 0) return true;
+
+  if (!is_bgr) {
+    // A Color is just the three bytes of an rgb pixel, so the image rows can
+    // be handed over as they are. If nothing is cut off at the sides, that is
+    // in one go, so that a canvas such as the FrameCanvas can write along its
+    // pixel mapping, or convert a whole frame at once.
+    static_assert(sizeof(Color) == 3, "Color must be packed red, green, blue");
+    if (skip_start_row + skip_end_row == 0) {
+      c->SetPixels(canvas_offset_x, canvas_offset_y, rect_w, rect_h,
+                   reinterpret_cast<const Color*>(buffer));
+      return true;
     }
-  } else {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[0], buffer[1], buffer[2]);
-        buffer += 3;
+    for (int y = 0; y < rect_h; ++y, buffer += row_bytes) {
+      c->SetPixels(canvas_offset_x, canvas_offset_y + y, rect_w, 1,
+                   reinterpret_cast<const Color*>(buffer));
+    }
+    return true;
+  }
+
+  // Swapped to rgb in blocks of as many rows as fit the buffer.
+  static const int kBufferPixels = 1024;
+  Color colors[kBufferPixels];
+  const int block_w = std::min(rect_w, kBufferPixels);
+  const int block_h = kBufferPixels / block_w;
+  for (int y = 0; y < rect_h; y += block_h) {
+    const int rows = std::min(block_h, rect_h - y);
+    for (int x = 0; x < rect_w; x += block_w) {
+      const int cols = std::min(block_w, rect_w - x);
+      Color *color = colors;
+      for (int row = y; row < y + rows; ++row) {
+        const uint8_t *pixel = buffer + row * row_bytes + 3 * x;
+        for (int col = 0; col < cols; ++col, ++color, pixel += 3) {
+          color->setColor(pixel[2], pixel[1], pixel[0]);
+        }
       }
-      buffer += next_row_skip;
+      c->SetPixels(canvas_offset_x + x, canvas_offset_y + y, cols, rows,
+                   colors);
     }
   }
   return true;
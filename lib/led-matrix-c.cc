@@ -89,6 +89,10 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(pulse_brightness);
+    OPT_COPY_IF_SET(display_list);
+    OPT_COPY_IF_SET(phase_timing);
+    OPT_COPY_IF_SET(sched_deadline);
 #undef OPT_COPY_IF_SET
   }
 
@@ -101,7 +105,16 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     RT_OPT_COPY_IF_SET(do_gpio_init);
     RT_OPT_COPY_IF_SET(drop_priv_user);
     RT_OPT_COPY_IF_SET(drop_priv_group);
+    RT_OPT_COPY_IF_SET(sleep_jitter_file);
+    RT_OPT_COPY_IF_SET(refresh_cpu);
+    RT_OPT_COPY_IF_SET(refresh_priority);
+    RT_OPT_COPY_IF_SET(refresh_policy);
+    RT_OPT_COPY_IF_SET(pixel_mapping_cache);
 #undef RT_OPT_COPY_IF_SET
+    if (rt_opts->gpio_recorder) {
+      default_rt.gpio_recorder
+        = static_cast<rgb_matrix::GPIORecorder*>(rt_opts->gpio_recorder);
+    }
   }
 
   rgb_matrix::RGBMatrix::Options matrix_options = default_opts;
@@ -136,6 +149,10 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(pulse_brightness);
+    ACTUAL_VALUE_BACK_TO_OPT(display_list);
+    ACTUAL_VALUE_BACK_TO_OPT(phase_timing);
+    ACTUAL_VALUE_BACK_TO_OPT(sched_deadline);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -147,7 +164,13 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_RT_OPT(do_gpio_init);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_user);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_group);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(sleep_jitter_file);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(refresh_cpu);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(refresh_priority);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(refresh_policy);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(pixel_mapping_cache);
 #undef ACTUAL_VALUE_BACK_TO_RT_OPT
+    rt_opts->gpio_recorder = runtime_opt.gpio_recorder;
   }
 
   rgb_matrix::RGBMatrix *matrix
@@ -207,6 +230,73 @@ struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+struct LedCanvas *led_matrix_create_mailbox(struct RGBLedMatrix *matrix,
+                                            int queue_depth) {
+  return from_canvas(to_matrix(matrix)->CreateMailbox(queue_depth));
+}
+
+struct LedCanvas *led_matrix_swap_latest(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas) {
+  return from_canvas(to_matrix(matrix)->SwapLatest(to_canvas(canvas)));
+}
+
+struct LedCanvas *led_matrix_create_frame_queue(struct RGBLedMatrix *matrix,
+                                                int queue_depth) {
+  return from_canvas(to_matrix(matrix)->CreateFrameQueue(queue_depth));
+}
+
+struct LedCanvas *led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                                         struct LedCanvas *canvas,
+                                         int64_t present_at_us) {
+  return from_canvas(to_matrix(matrix)->QueueFrame(to_canvas(canvas),
+                                                   present_at_us));
+}
+
+void led_matrix_get_frame_queue_stats(struct RGBLedMatrix *matrix,
+                                      uint64_t *shown, uint64_t *late,
+                                      uint64_t *dropped) {
+  const rgb_matrix::RGBMatrix::FrameQueueStats stats
+    = to_matrix(matrix)->GetFrameQueueStats();
+  if (shown) *shown = stats.shown;
+  if (late) *late = stats.late;
+  if (dropped) *dropped = stats.dropped;
+}
+
+void led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                  struct LedRefreshStats *out) {
+  typedef rgb_matrix::RGBMatrix::RefreshStats RefreshStats;
+  static_assert(sizeof(out->frame_time_histogram)
+                == sizeof(RefreshStats().frame_time_histogram),
+                "Keep C histogram in sync with RGBMatrix::RefreshStats");
+  const RefreshStats stats = to_matrix(matrix)->GetRefreshStats();
+  out->frames = stats.frames;
+  out->min_frame_us = stats.min_frame_us;
+  out->avg_frame_us = stats.avg_frame_us;
+  out->p99_frame_us = stats.p99_frame_us;
+  out->max_frame_us = stats.max_frame_us;
+  memcpy(out->frame_time_histogram, stats.frame_time_histogram,
+         sizeof(out->frame_time_histogram));
+  out->last_swap_latency_us = stats.last_swap_latency_us;
+  out->max_swap_latency_us = stats.max_swap_latency_us;
+  out->frames_held_for_fraction = stats.frames_held_for_fraction;
+  out->pulse_wait_us = stats.pulse_wait_us;
+}
+
+void led_matrix_set_sleep_jitter_recording(struct RGBLedMatrix *matrix,
+                                           int enable) {
+  to_matrix(matrix)->SetSleepJitterRecording(enable != 0);
+}
+
+void led_matrix_get_sleep_jitter(struct RGBLedMatrix *matrix,
+                                 struct LedSleepJitter *out) {
+  typedef rgb_matrix::RGBMatrix::SleepJitter SleepJitter;
+  static_assert(sizeof(out->overshoot_us) == sizeof(SleepJitter().overshoot_us),
+                "Keep C histogram in sync with RGBMatrix::SleepJitter");
+  const SleepJitter jitter = to_matrix(matrix)->GetSleepJitter();
+  out->allowance_us = jitter.allowance_us;
+  memcpy(out->overshoot_us, jitter.overshoot_us, sizeof(out->overshoot_us));
+}
+
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix,
                                uint8_t brightness) {
   to_matrix(matrix)->SetBrightness(brightness);
@@ -20,18 +20,26 @@
 #include <pwd.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
+#include "pixel-mapping-cache-internal.h"
 #include "multiplex-mappers-internal.h"
 
 // Leave this in here for a while. Setting things from old defines.
@@ -62,7 +70,11 @@ public:
   //
   // The resulting canvas is (options.rows * options.parallel) high and
   // (32 * options.chain_length) wide.
-  Impl(GPIO *io, const Options &options);
+  //
+  // With a "pixel_mapping_cache" directory, the pixel mapping is loaded from
+  // there if it has been stored for the same options before.
+  Impl(GPIO *io, const Options &options,
+       const char *pixel_mapping_cache = NULL);
 
   ~Impl();
 
@@ -70,10 +82,21 @@ public:
   // these days only used internally.
   void SetGPIO(GPIO *io, bool start_thread = true);
 
+  // Run the refresh thread on "cpu" (-1: pick automatically) with the
+  // given scheduling policy and priority. Call before StartRefresh().
+  void SetRefreshScheduling(int cpu, int policy, int priority);
+
   bool StartRefresh();
 
   FrameCanvas *CreateFrameCanvas();
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
+  FrameCanvas *CreateMailbox(int queue_depth);
+  FrameCanvas *SwapLatest(FrameCanvas *frame);
+  FrameCanvas *CreateFrameQueue(int queue_depth);
+  FrameCanvas *QueueFrame(FrameCanvas *frame, int64_t present_at_us);
+  FrameQueueStats GetFrameQueueStats();
+  RefreshStats GetRefreshStats();
+  PhaseTiming GetPhaseTiming();
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
   bool SetPWMBits(uint8_t value);
@@ -83,7 +106,7 @@ public:
   bool luminance_correct() const;
 
   // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // This will only affect newly set pixels, unless pulse_brightness is set.
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
@@ -101,35 +124,166 @@ private:
   void ApplyNamedPixelMappers(const char *pixel_mapper_config,
                               int chain, int parallel);
 
+  // Canvases cycled through by the mailbox or the frame queue.
+  FrameCanvas *CreateFramePool(int pool_size, bool timed);
+  // Returns NULL if all canvases are with the application already.
+  FrameCanvas *NextFreeFrame();  // Call with frame_pool_sync_ held.
+
   Options params_;
   bool do_luminance_correct_;
 
+  internal::MatrixHardware hardware_;
+
   FrameCanvas *active_;
 
   GPIO *io_;
+  GPIO recording_io_;  // Used if writing to a GPIORecorder.
   Mutex active_frame_sync_;
   UpdateThread *updater_;
+  int refresh_cpu_;
+  int refresh_policy_;
+  int refresh_priority_;
+  int claimed_refresh_cpu_;  // -1 if none.
   std::vector<FrameCanvas*> created_frames_;
+
+  Mutex frame_pool_sync_;                       // Between app threads.
+  std::vector<FrameCanvas*> frame_pool_free_;   // Canvases ready for drawing.
+  enum { kNoFramePool, kMailbox, kFrameQueue } frame_pool_mode_;
+  // Canvases the refresh thread is still going to release: one for every
+  // frame posted or queued, as showing it releases the one shown before.
+  int frame_pool_releases_due_;
+
   internal::PixelDesignatorMap *shared_pixel_mapper_;
   uint64_t user_output_bits_;
 };
 
 using namespace internal;
 
+// Minimal futex wrappers to wait for/announce a change of a sequence number
+// without any lock shared with the refresh thread.
+// Wait while "*word == expected", at most "timeout_ms" if that is >= 0.
+static void FutexWait(std::atomic<int> *word, int expected, long timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE,
+          expected, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+static void FutexWakeAll(std::atomic<int> *word) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE,
+          INT32_MAX, NULL, NULL, 0);
+}
+
+static int64_t MonotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t MonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Switch the calling thread to SCHED_DEADLINE: the kernel then wakes it up
+// at the start of each "period_ns" with a budget of most of that period.
+// Not in all libc versions yet, so we talk to the kernel directly.
+static bool EnterDeadlineScheduling(int64_t period_ns) {
+#ifdef SYS_sched_setattr
+  struct {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+  } attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.sched_policy = 6;  // SCHED_DEADLINE
+  attr.sched_runtime = period_ns / 10 * 9;
+  attr.sched_deadline = period_ns;
+  attr.sched_period = period_ns;
+  if (syscall(SYS_sched_setattr, 0, &attr, 0) != 0) {
+    perror("Can't use SCHED_DEADLINE; pacing refresh with sleeps instead");
+    return false;
+  }
+  // Only trust the policy actually in effect.
+  if (sched_getscheduler(0) == (int)attr.sched_policy)
+    return true;
+  fprintf(stderr, "SCHED_DEADLINE did not take effect; pacing refresh with "
+          "sleeps instead.\n");
+#else
+  fprintf(stderr, "SCHED_DEADLINE not supported; pacing refresh with sleeps "
+          "instead.\n");
+#endif
+  return false;
+}
+
+// Number of matrices in this process that refresh on each CPU. Other threads
+// started by the library stay off these CPUs.
+static Mutex sRefreshCPUsLock;
+static int sRefreshCPUUsers[32];
+
+static uint32_t RefreshCPUsLocked() {
+  uint32_t cpus = 0;
+  for (int i = 0; i < 32; ++i) {
+    if (sRefreshCPUUsers[i] > 0) cpus |= 1u << i;
+  }
+  return cpus;
+}
+
+// Claim "cpu" for a refresh thread, or with cpu < 0 the best one not used by
+// another matrix yet. Returns the claimed CPU or -1 if there is no choice.
+static int ClaimRefreshCPU(int cpu) {
+  MutexLock l(&sRefreshCPUsLock);
+  if (cpu < 0) cpu = DefaultRefreshCPU(RefreshCPUsLocked());
+  if (cpu < 0) return -1;
+  ++sRefreshCPUUsers[cpu];
+  Thread::SetAvoidedCPUs(RefreshCPUsLocked());
+  return cpu;
+}
+
+static void ReleaseRefreshCPU(int cpu) {
+  if (cpu < 0) return;
+  MutexLock l(&sRefreshCPUsLock);
+  --sRefreshCPUUsers[cpu];
+  Thread::SetAvoidedCPUs(RefreshCPUsLocked());
+}
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
-  UpdateThread(GPIO *io, FrameCanvas *initial_frame,
+  UpdateThread(GPIO *io, MatrixHardware *hardware, FrameCanvas *initial_frame,
                int pwm_dither_bits, bool show_refresh,
-               int limit_refresh_hz, bool allow_busy_waiting)
-    : io_(io), show_refresh_(show_refresh),
-      target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
+               int limit_refresh_hz, bool allow_busy_waiting,
+               bool phase_timing, bool sched_deadline)
+    : io_(io), hardware_(hardware), show_refresh_(show_refresh),
+      phase_timing_(phase_timing ? new Framebuffer::DumpPhaseTiming() : NULL),
+      target_frame_ns_(limit_refresh_hz < 1 ? 0 : 1000000000/limit_refresh_hz),
       allow_busy_waiting_(allow_busy_waiting),
+      sched_deadline_(sched_deadline && target_frame_ns_ > 0),
+      fallback_policy_(SCHED_OTHER), fallback_priority_(0),
+      fallback_affinity_(0),
       running_(true),
+      input_change_seq_(0), gpio_inputs_(0), input_waiters_(0),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
-    pthread_cond_init(&input_change_, NULL);
+      requested_frame_multiple_(1), pulse_brightness_(100),
+      frame_done_seq_(0), frame_waiters_(0),
+      latest_frame_(NULL), released_head_(0), released_tail_(0),
+      release_waiters_(0), frame_queue_active_(false),
+      queue_head_(0), queue_tail_(0),
+      stats_seq_(0), swap_requested_us_(0) {
     switch (pwm_dither_bits) {
     case 0:
       start_bit_[0] = 0; start_bit_[1] = 0;
@@ -146,9 +300,12 @@ public:
     }
   }
 
+  ~UpdateThread() {
+    delete phase_timing_;
+  }
+
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false);
   }
 
   virtual void Run() {
@@ -162,54 +319,120 @@ public:
     static const int kHoldffTimeUs = 2000 * 1000;
     uint32_t initial_holdoff_start = GetMicrosecondCounter();
     bool max_measure_enabled = false;
+    uint8_t applied_pulse_brightness = 100;
+    uint8_t pulse_brightness = pulse_brightness_;  // Set before Start().
+    int64_t last_boundary_us = 0;
+
+    // With a refresh limit, frames are paced against absolute deadlines, so
+    // time spent elsewhere in the loop never accumulates as drift; or by
+    // the kernel if we are allowed to use SCHED_DEADLINE.
+    const bool kernel_paced = sched_deadline_
+      && EnterDeadlineScheduling(target_frame_ns_);
+    if (sched_deadline_ && !kernel_paced) ApplyDeadlineFallback();
+    int64_t frame_deadline_ns = MonotonicNanos();
 
     while (running()) {
+      FrameEvents events;
+
+      if (pulse_brightness != applied_pulse_brightness) {
+        hardware_->SetOutputEnableScale(pulse_brightness);
+        applied_pulse_brightness = pulse_brightness;
+      }
+
       const uint32_t start_time_us = GetMicrosecondCounter();
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
-
-      // SwapOnVSync() exchange.
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
+      current_frame_.load()->framebuffer()
+        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4], phase_timing_);
+
+      // Mailbox: always switch to the newest frame posted, and hand the one
+      // we switch away from back to the application.
+      FrameCanvas *const latest = latest_frame_.exchange(NULL);
+      if (latest != NULL) {
+        ReleaseFrame(current_frame_.exchange(latest));
+        events.swap_latency_us = SwapLatency();
+      }
+
+      // Frame queue: show the newest frame that is due. Earlier frames that
+      // are due as well would only be visible for no time at all; drop them.
+      if (frame_queue_active_.load(std::memory_order_relaxed)) {
+        const int64_t now_us = MonotonicMicros();
+        const int head = queue_head_.load();
+        int tail = queue_tail_.load(std::memory_order_relaxed);
+        const TimedFrame *due = NULL;
+        while (tail != head
+               && queued_frames_[tail & (queued_frames_.size() - 1)]
+               .present_at_us <= now_us) {
+          if (due != NULL) {
+            ReleaseFrame(due->frame);
+            ++events.queue_dropped;
           }
-          pthread_cond_signal(&frame_done_);
+          due = &queued_frames_[tail & (queued_frames_.size() - 1)];
+          ++tail;
+        }
+        if (due != NULL) {
+          // Could have been shown at the previous boundary already ?
+          if (due->present_at_us <= last_boundary_us) {
+            ++events.queue_late;
+          }
+          ++events.queue_shown;
+          ReleaseFrame(current_frame_.exchange(due->frame));
+          queue_tail_.store(tail);  // Only now the slots can be reused.
+        }
+        last_boundary_us = now_us;
+      }
+
+      // SwapOnVSync() exchange. Nothing in here ever waits for the
+      // application thread; it only gets woken up if it is waiting.
+      const unsigned frame_multiple = requested_frame_multiple_.load();
+      // Do fast equality test first (likely due to frame_count reset).
+      if (frame_count == frame_multiple || frame_count % frame_multiple == 0) {
+        // We reset to avoid frame hick-up every couple of weeks
+        // run-time iff requested_frame_multiple_ is not a factor of 2^32.
+        frame_count = 0;
+        FrameCanvas *const next = next_frame_.exchange(NULL);
+        if (next != NULL) {
+          current_frame_.store(next);
+          events.swap_latency_us = SwapLatency();
+        }
+        frame_done_seq_.fetch_add(1);
+        if (frame_waiters_.load() > 0) {
+          FutexWakeAll(&frame_done_seq_);
         }
+      } else if (next_frame_.load(std::memory_order_relaxed) != NULL) {
+        events.held_for_fraction = true;
       }
+      pulse_brightness = pulse_brightness_.load(std::memory_order_relaxed);
 
       // Read input bits.
       const gpio_bits_t inputs = io_->Read();
       if (inputs != last_gpio_bits) {
         last_gpio_bits = inputs;
-        MutexLock l(&input_sync_);
-        gpio_inputs_ = inputs;
-        pthread_cond_signal(&input_change_);
+        gpio_inputs_.store(inputs);
+        input_change_seq_.fetch_add(1);
+        if (input_waiters_.load() > 0) {
+          FutexWakeAll(&input_change_seq_);
+        }
       }
 
       ++frame_count;
       ++low_bit_sequence;
 
-      if (target_frame_usec_) {
-        if (allow_busy_waiting_) {
-          while ((GetMicrosecondCounter() - start_time_us) < target_frame_usec_) {
-            // busy wait. We have our dedicated core, so ok to burn cycles.
-          }
-        } else {
-          long spent_us = GetMicrosecondCounter() - start_time_us;
-          SleepMicroseconds(target_frame_usec_ - spent_us);
+      if (kernel_paced) {
+        sched_yield();  // Gives up the rest of this period.
+      } else if (target_frame_ns_) {
+        // If we fell behind by more than a frame, start over from now
+        // instead of rushing through frames to catch up.
+        frame_deadline_ns += target_frame_ns_;
+        const int64_t now_ns = MonotonicNanos();
+        if (frame_deadline_ns < now_ns - target_frame_ns_) {
+          frame_deadline_ns = now_ns;
         }
+        // Busy waiting only for the last bit after sleeping.
+        SleepUntilMonotonicNanos(frame_deadline_ns, allow_busy_waiting_);
       }
 
       const uint32_t end_time_us = GetMicrosecondCounter();
+      PublishStats(end_time_us - start_time_us, events);
       if (show_refresh_) {
         uint32_t usec = end_time_us - start_time_us;
         printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
@@ -227,44 +450,318 @@ public:
   }
 
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
+    MutexLock l(&swap_sync_);  // Only between application threads.
+    FrameCanvas *previous = current_frame_.load();
+    requested_frame_multiple_.store(frame_fraction);
+    frame_waiters_.fetch_add(1);
+    if (other != NULL) {
+      // Wait until the refresh thread has picked up our frame.
+      swap_requested_us_.store(GetMicrosecondCounter());
+      next_frame_.store(other);
+      for (;;) {
+        const int seq = frame_done_seq_.load();
+        if (next_frame_.load() != other) break;
+        FutexWait(&frame_done_seq_, seq, -1);
+      }
+    } else {
+      // Just wait for the next vsync.
+      const int seq = frame_done_seq_.load();
+      while (frame_done_seq_.load() == seq) {
+        FutexWait(&frame_done_seq_, seq, -1);
+      }
+    }
+    frame_waiters_.fetch_sub(1);
     return previous;
   }
 
+  // Prepare the rings for a pool of "pool_size" canvases to be cycled
+  // through with PostLatest() or, if "timed", with QueueFrame().
+  // Call before either of these.
+  void InitFramePool(int pool_size, bool timed) {
+    size_t size = 1;
+    while (size < (size_t)pool_size) size <<= 1;
+    released_frames_.resize(size, NULL);
+    if (timed) {
+      const TimedFrame empty = { NULL, 0 };
+      queued_frames_.resize(size, empty);
+      frame_queue_active_.store(true);
+    }
+  }
+
+  // Make "frame" the newest frame to show. Returns the frame it replaced if
+  // that was not picked up yet, NULL otherwise.
+  FrameCanvas *PostLatest(FrameCanvas *frame) {
+    swap_requested_us_.store(GetMicrosecondCounter());
+    return latest_frame_.exchange(frame);
+  }
+
+  // Append "frame" to the queue, to be shown from "present_at_us" on.
+  // Needs to be in order of presentation time, and there is always room as
+  // long as only canvases of the pool are queued.
+  // Only one thread at a time must call this.
+  void QueueFrame(FrameCanvas *frame, int64_t present_at_us) {
+    const int head = queue_head_.load(std::memory_order_relaxed);
+    TimedFrame *const slot = &queued_frames_[head & (queued_frames_.size()-1)];
+    slot->frame = frame;
+    slot->present_at_us = present_at_us;
+    queue_head_.store(head + 1);
+  }
+
+  RGBMatrix::FrameQueueStats GetFrameQueueStats() const {
+    Stats *const stats = new Stats();  // Large; don't put on the stack.
+    ReadStats(stats);
+    const RGBMatrix::FrameQueueStats result = stats->queue;
+    delete stats;
+    return result;
+  }
+
+  RGBMatrix::PhaseTiming GetPhaseTiming() const {
+    typedef Framebuffer::DumpPhaseTiming T;
+    static_assert((int)RGBMatrix::PhaseTiming::kPlanes
+                  == (int)Framebuffer::kBitPlanes,
+                  "PhaseTiming needs to cover all bitplanes");
+    Stats *const stats = new Stats();
+    ReadStats(stats);
+    RGBMatrix::PhaseTiming result;
+    const uint64_t tick_hz = GetTickCounterFrequency();
+    const T &t = stats->phases;
+#define TICKS_TO_NS(phase, plane) \
+    (t.ticks[phase][plane] * 1000000000.0 / tick_hz)
+    for (int b = 0; b < Framebuffer::kBitPlanes; ++b) {
+      result.rows[b] = t.rows[b];
+      result.clock_out_ns[b] = TICKS_TO_NS(T::kClockOut, b);
+      result.pulse_wait_ns[b] = TICKS_TO_NS(T::kPulseWait, b);
+      result.row_address_ns[b] = TICKS_TO_NS(T::kRowAddress, b);
+      result.strobe_ns[b] = TICKS_TO_NS(T::kStrobe, b);
+      result.pulse_ns[b] = TICKS_TO_NS(T::kPulse, b);
+    }
+#undef TICKS_TO_NS
+    delete stats;
+    return result;
+  }
+
+  RGBMatrix::RefreshStats GetRefreshStats() const {
+    Stats *const stats = new Stats();
+    ReadStats(stats);
+    RGBMatrix::RefreshStats result = stats->refresh;
+    const int kWindow = RGBMatrix::RefreshStats::kFrameWindow;
+    const int n = result.frames < (uint64_t)kWindow ? result.frames : kWindow;
+    if (n > 0) {
+      uint32_t *const window = stats->frame_window;
+      std::sort(window, window + n);
+      uint64_t sum = 0;
+      for (int i = 0; i < n; ++i) sum += window[i];
+      result.min_frame_us = window[0];
+      result.avg_frame_us = sum / n;
+      result.p99_frame_us = window[(n - 1) * 99 / 100];
+      result.max_frame_us = window[n - 1];
+    }
+    delete stats;
+    return result;
+  }
+
+  // Get a frame the refresh thread has switched away from. If there is none
+  // yet, return NULL or, with "wait", wait for the next one.
+  // Only one thread at a time must call this.
+  FrameCanvas *PopReleasedFrame(bool wait) {
+    int head = released_head_.load();
+    if (head == released_tail_) {
+      if (!wait) return NULL;
+      release_waiters_.fetch_add(1);
+      while ((head = released_head_.load()) == released_tail_) {
+        FutexWait(&released_head_, head, -1);
+      }
+      release_waiters_.fetch_sub(1);
+    }
+    FrameCanvas *const result
+      = released_frames_[released_tail_ & (released_frames_.size() - 1)];
+    ++released_tail_;
+    return result;
+  }
+
+  // If the refresh is paced by SCHED_DEADLINE. The thread then sets its
+  // scheduling itself, so it needs to be started without a realtime policy;
+  // if the kernel refuses, it falls back to this policy, priority and
+  // affinity. Call before Start().
+  bool sched_deadline() const { return sched_deadline_; }
+  void SetDeadlineFallback(int policy, int priority, uint32_t affinity) {
+    fallback_policy_ = policy;
+    fallback_priority_ = priority;
+    fallback_affinity_ = affinity;
+  }
+
+  // Dim by output-enable time; picked up before the next frame is shown.
+  void SetPulseBrightness(uint8_t percent) {
+    pulse_brightness_.store(percent, std::memory_order_relaxed);
+  }
+
   gpio_bits_t AwaitInputChange(int timeout_ms) {
-    MutexLock l(&input_sync_);
-    input_sync_.WaitOn(&input_change_, timeout_ms);
-    return gpio_inputs_;
+    const int seq = input_change_seq_.load();
+    if (timeout_ms != 0) {
+      input_waiters_.fetch_add(1);
+      const int64_t deadline = MonotonicMillis() + timeout_ms;
+      long remaining = timeout_ms;
+      while (input_change_seq_.load() == seq) {
+        FutexWait(&input_change_seq_, seq, remaining);
+        if (timeout_ms > 0) {
+          remaining = deadline - MonotonicMillis();
+          if (remaining <= 0) break;
+        }
+      }
+      input_waiters_.fetch_sub(1);
+    }
+    return gpio_inputs_.load();
   }
 
 private:
   inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+    return running_.load(std::memory_order_relaxed);
+  }
+
+  // What happened at a frame boundary, to be added to the statistics.
+  struct FrameEvents {
+    FrameEvents() : swap_latency_us(-1), held_for_fraction(false),
+                    queue_shown(0), queue_late(0), queue_dropped(0) {}
+    int64_t swap_latency_us;   // -1 if no swap
+    bool held_for_fraction;
+    int queue_shown;
+    int queue_late;
+    int queue_dropped;
+  };
+
+  // Statistics, only written by the refresh thread. Readers get a
+  // consistent copy with the sequence lock stats_seq_, which is odd while
+  // an update is in progress.
+  struct Stats {
+    RGBMatrix::RefreshStats refresh;  // Window values filled in by reader.
+    RGBMatrix::FrameQueueStats queue;
+    Framebuffer::DumpPhaseTiming phases;  // Only with phase_timing_
+    uint32_t frame_window[RGBMatrix::RefreshStats::kFrameWindow];
+  };
+
+  uint32_t SwapLatency() const {
+    return GetMicrosecondCounter() - swap_requested_us_.load();
+  }
+
+  void PublishStats(uint32_t frame_us, const FrameEvents &events) {
+    const uint32_t seq = stats_seq_.load(std::memory_order_relaxed);
+    stats_seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    typedef RGBMatrix::RefreshStats RS;
+    RS &r = stats_.refresh;
+    stats_.frame_window[r.frames % RS::kFrameWindow] = frame_us;
+    ++r.frames;
+    const uint32_t bucket = std::min(frame_us / RS::kHistogramBucketUs,
+                                     (uint32_t)RS::kHistogramBuckets - 1);
+    r.frame_time_histogram[bucket]++;
+    if (events.swap_latency_us >= 0) {
+      r.last_swap_latency_us = events.swap_latency_us;
+      r.max_swap_latency_us = std::max(r.max_swap_latency_us,
+                                       r.last_swap_latency_us);
+    }
+    if (events.held_for_fraction) ++r.frames_held_for_fraction;
+    r.pulse_wait_us = hardware_->OutputEnableWaitMicroseconds();
+    stats_.queue.shown += events.queue_shown;
+    stats_.queue.late += events.queue_late;
+    stats_.queue.dropped += events.queue_dropped;
+    if (phase_timing_) stats_.phases = *phase_timing_;
+
+    stats_seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  void ReadStats(Stats *out) const {
+    for (;;) {
+      const uint32_t seq = stats_seq_.load(std::memory_order_acquire);
+      if (seq & 1) continue;  // Update in progress; only takes a moment.
+      memcpy(out, &stats_, sizeof(*out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (stats_seq_.load(std::memory_order_relaxed) == seq) return;
+    }
+  }
+
+  // Hand a frame we don't show anymore back to PopReleasedFrame().
+  void ReleaseFrame(FrameCanvas *frame) {
+    const int head = released_head_.load(std::memory_order_relaxed);
+    released_frames_[head & (released_frames_.size() - 1)] = frame;
+    released_head_.store(head + 1);
+    if (release_waiters_.load() > 0) {
+      FutexWakeAll(&released_head_);
+    }
+  }
+
+  // Scheduling of a refresh thread that could not use SCHED_DEADLINE.
+  void ApplyDeadlineFallback() {
+    if (fallback_priority_ > 0 && fallback_policy_ != SCHED_OTHER) {
+      struct sched_param p;
+      p.sched_priority = fallback_priority_;
+      const int err = pthread_setschedparam(pthread_self(), fallback_policy_,
+                                            &p);
+      if (err) {
+        fprintf(stderr, "Can't set realtime priority=%d of the refresh "
+                "thread: %s\n", fallback_priority_, strerror(err));
+      }
+    }
+    if (fallback_affinity_ != 0) {
+      cpu_set_t cpu_mask;
+      CPU_ZERO(&cpu_mask);
+      for (int i = 0; i < 32; ++i) {
+        if (fallback_affinity_ & (1u << i)) CPU_SET(i, &cpu_mask);
+      }
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_mask), &cpu_mask);
+    }
   }
 
   GPIO *const io_;
+  MatrixHardware *const hardware_;
   const bool show_refresh_;
-  const uint32_t target_frame_usec_;
+  Framebuffer::DumpPhaseTiming *const phase_timing_;
+  const int64_t target_frame_ns_;
   const bool allow_busy_waiting_;
+  const bool sched_deadline_;
+  int fallback_policy_;
+  int fallback_priority_;
+  uint32_t fallback_affinity_;
   uint32_t start_bit_[4];
 
-  Mutex running_mutex_;
-  bool running_;
-
-  Mutex input_sync_;
-  pthread_cond_t input_change_;
-  gpio_bits_t gpio_inputs_;
-
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
-  unsigned requested_frame_multiple_;
+  // The refresh thread never takes a lock: everything shared with the
+  // application threads is atomic, and waiting for a change is done on a
+  // futex sequence number that the refresh thread bumps.
+  std::atomic<bool> running_;
+
+  std::atomic<int> input_change_seq_;
+  std::atomic<gpio_bits_t> gpio_inputs_;
+  std::atomic<int> input_waiters_;
+
+  Mutex swap_sync_;
+  std::atomic<FrameCanvas*> current_frame_;
+  std::atomic<FrameCanvas*> next_frame_;
+  std::atomic<unsigned> requested_frame_multiple_;
+  std::atomic<uint8_t> pulse_brightness_;
+  std::atomic<int> frame_done_seq_;
+  std::atomic<int> frame_waiters_;
+
+  // Mailbox and frame queue. Frames the refresh thread switched away from
+  // go into a ring buffer (power of two size, at least the number of
+  // canvases in the pool). Same for frames queued for a presentation time.
+  std::atomic<FrameCanvas*> latest_frame_;
+  std::vector<FrameCanvas*> released_frames_;
+  std::atomic<int> released_head_;   // Written by the refresh thread.
+  int released_tail_;                // Written by the application.
+  std::atomic<int> release_waiters_;
+
+  struct TimedFrame {
+    FrameCanvas *frame;
+    int64_t present_at_us;
+  };
+  std::atomic<bool> frame_queue_active_;
+  std::vector<TimedFrame> queued_frames_;
+  std::atomic<int> queue_head_;      // Written by the application.
+  std::atomic<int> queue_tail_;      // Written by the refresh thread.
+
+  std::atomic<uint32_t> stats_seq_;
+  Stats stats_;
+  std::atomic<uint32_t> swap_requested_us_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -325,10 +822,14 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  pulse_brightness(false),
+  display_list(false),
+  phase_timing(false),
+  sched_deadline(false)
 {
   // Nothing to see here.
 }
@@ -360,15 +861,23 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_BOOL(pulse_brightness);
+  P_BOOL(display_list);
+  P_BOOL(phase_timing);
+  P_BOOL(sched_deadline);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
 }
 #endif  // DEBUG_MATRIX_OPTIONS
 
-RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
-    user_output_bits_(0) {
+RGBMatrix::Impl::Impl(GPIO *io, const Options &options,
+                      const char *pixel_mapping_cache)
+  : params_(options), io_(NULL), updater_(NULL), refresh_cpu_(-1),
+    refresh_policy_(SCHED_FIFO), refresh_priority_(99),
+    claimed_refresh_cpu_(-1),
+    frame_pool_mode_(kNoFramePool), frame_pool_releases_due_(0),
+    shared_pixel_mapper_(NULL), user_output_bits_(0) {
   assert(params_.Validate(NULL));
 #if DEBUG_MATRIX_OPTIONS
   PrintOptions(params_);
@@ -388,26 +897,54 @@ RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
     multiplex_mapper->EditColsRows(&params_.cols, &params_.rows);
   }
 
-  Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  hardware_.InitHardwareMapping(params_.hardware_mapping);
 
   active_ = CreateFrameCanvas();
   active_->Clear();
   SetGPIO(io, true);
 
+  const PixelMappingCache cache(pixel_mapping_cache, options,
+                                hardware_.mapping().name);
+  PixelDesignatorMap *const cached
+    = cache.Load(*active_->framebuffer(),
+                 shared_pixel_mapper_->GetColorTable());
+  if (cached) {
+    delete shared_pixel_mapper_;
+    shared_pixel_mapper_ = cached;
+    return;
+  }
+
   // We need to apply the mapping for the panels first.
   ApplyPixelMapper(multiplex_mapper);
 
   // .. followed by higher level mappers that might arrange panels.
   ApplyNamedPixelMappers(options.pixel_mapper_config,
                          params_.chain_length, params_.parallel);
+
+  cache.Store(*shared_pixel_mapper_);
+}
+
+static void PrintPhaseTiming(const RGBMatrix::PhaseTiming &t) {
+  fprintf(stderr, "Average time per row in microseconds:\n"
+          "plane       rows  clock-out pulse-wait  row-addr    strobe     pulse\n");
+  for (int b = RGBMatrix::PhaseTiming::kPlanes - 1; b >= 0; --b) {
+    if (t.rows[b] == 0) continue;
+    const double n = t.rows[b] * 1000.0;
+    fprintf(stderr, "%5d %10llu %10.2f %10.2f %9.2f %9.2f %9.2f\n",
+            b, (unsigned long long)t.rows[b],
+            t.clock_out_ns[b] / n, t.pulse_wait_ns[b] / n,
+            t.row_address_ns[b] / n, t.strobe_ns[b] / n, t.pulse_ns[b] / n);
+  }
 }
 
 RGBMatrix::Impl::~Impl() {
   if (updater_) {
     updater_->Stop();
     updater_->WaitStopped();
+    if (params_.phase_timing) PrintPhaseTiming(updater_->GetPhaseTiming());
   }
   delete updater_;
+  ReleaseRefreshCPU(claimed_refresh_cpu_);
 
   // Make sure LEDs are off.
   active_->Clear();
@@ -465,39 +1002,70 @@ void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
 void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
   if (io != NULL && io_ == NULL) {
     io_ = io;
-    Framebuffer::InitGPIO(io_, params_.rows, params_.parallel,
-                          !params_.disable_hardware_pulsing,
-                          params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
-                          params_.row_address_type);
-    Framebuffer::InitializePanels(io_, params_.panel_type,
-                                  params_.cols * params_.chain_length);
+    hardware_.InitGPIO(io_, params_.rows, params_.parallel,
+                       !params_.disable_hardware_pulsing,
+                       params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
+                       params_.row_address_type);
+    hardware_.InitializePanels(io_, params_.panel_type,
+                               params_.cols * params_.chain_length);
   }
   if (start_thread) {
     StartRefresh();
   }
 }
 
+void RGBMatrix::Impl::SetRefreshScheduling(int cpu, int policy,
+                                           int priority) {
+  refresh_cpu_ = cpu;
+  refresh_policy_ = policy;
+  refresh_priority_ = priority;
+}
+
 bool RGBMatrix::Impl::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
-    updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
+    updater_ = new UpdateThread(io_, &hardware_, active_,
+                                params_.pwm_dither_bits,
                                 params_.show_refresh_rate,
                                 params_.limit_refresh_rate_hz,
-                                !params_.disable_busy_waiting);
+                                !params_.disable_busy_waiting,
+                                params_.phase_timing,
+                                params_.sched_deadline);
+    if (params_.pulse_brightness) {
+      updater_->SetPulseBrightness(params_.brightness);
+    }
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
-    // So let's tie it to the last CPU available.
-    // The Raspberry Pi2 has 4 cores, our attempt to bind it to
-    //   core #3 will succeed.
-    // The Raspberry Pi1 only has one core, so this affinity
-    //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    // So let's tie it to one CPU, ideally one isolated from everything else.
+    // The Raspberry Pi1 only has one core, so there is nothing to choose.
+    //
+    // With several matrices, each refresh thread gets its own CPU as long
+    // as there are enough. A SCHED_DEADLINE thread must be free to run on any
+    // CPU though.
+    const int cpu = ClaimRefreshCPU(refresh_cpu_);
+    uint32_t affinity = 0;
+    if (cpu >= 0) {
+      PrepareRefreshCPU(cpu);
+      claimed_refresh_cpu_ = cpu;
+      affinity = 1u << cpu;
+    }
+    if (updater_->sched_deadline()) {
+      // The thread switches to SCHED_DEADLINE itself; setting a realtime
+      // policy from here could race with that and undo it. It also needs all
+      // CPUs of its scheduling domain, so it must not be kept off the other
+      // refresh CPUs or even its own.
+      updater_->SetDeadlineFallback(refresh_policy_, refresh_priority_,
+                                    affinity);
+      updater_->StartWithPolicy(SCHED_OTHER, 0, 0, false);
+    } else {
+      updater_->StartWithPolicy(refresh_policy_, refresh_priority_, affinity);
+    }
   }
   return updater_ != NULL;
 }
 
 FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
   FrameCanvas *result =
-    new FrameCanvas(new Framebuffer(params_.rows,
+    new FrameCanvas(new Framebuffer(&hardware_, params_.rows,
                                     params_.cols * params_.chain_length,
                                     params_.parallel,
                                     params_.scan_mode,
@@ -511,7 +1079,8 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
 
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
-  result->framebuffer()->SetBrightness(params_.brightness);
+  result->framebuffer()->SetBrightness(params_.pulse_brightness
+                                       ? 100 : params_.brightness);
 
   created_frames_.push_back(result);
 
@@ -535,11 +1104,125 @@ FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
+  if (other && params_.display_list) {
+    other->framebuffer()->CompileDisplayList();
+  }
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
   if (other) active_ = other;
   return previous;
 }
 
+FrameCanvas *RGBMatrix::Impl::CreateFramePool(int pool_size, bool timed) {
+  if (pool_size < 3) pool_size = 3;  // shown, waiting, drawing.
+  updater_->InitFramePool(pool_size, timed);
+  // The currently shown canvas joins the pool once it is replaced.
+  for (int i = 0; i < pool_size - 2; ++i) {
+    frame_pool_free_.push_back(CreateFrameCanvas());
+  }
+  return CreateFrameCanvas();
+}
+
+FrameCanvas *RGBMatrix::Impl::NextFreeFrame() {
+  FrameCanvas *released;
+  while ((released = updater_->PopReleasedFrame(false)) != NULL) {
+    frame_pool_free_.push_back(released);
+    --frame_pool_releases_due_;
+  }
+  if (!frame_pool_free_.empty()) {
+    FrameCanvas *const result = frame_pool_free_.back();
+    frame_pool_free_.pop_back();
+    return result;
+  }
+  // Nothing posted that would replace the shown frame: no canvas is ever
+  // going to be released, so don't wait for one.
+  if (frame_pool_releases_due_ == 0) return NULL;
+
+  // Everything is shown or waiting to be shown: wait until the refresh
+  // thread switches to the next frame.
+  --frame_pool_releases_due_;
+  return updater_->PopReleasedFrame(true);
+}
+
+FrameCanvas *RGBMatrix::Impl::CreateMailbox(int queue_depth) {
+  if (!updater_) return NULL;
+  MutexLock l(&frame_pool_sync_);
+  if (frame_pool_mode_ != kNoFramePool) return NULL;
+  frame_pool_mode_ = kMailbox;
+  return CreateFramePool(queue_depth, false);
+}
+
+FrameCanvas *RGBMatrix::Impl::SwapLatest(FrameCanvas *frame) {
+  if (!updater_) return NULL;
+  MutexLock l(&frame_pool_sync_);
+  if (frame_pool_mode_ != kMailbox) return NULL;
+  if (frame != NULL) {
+    if (params_.display_list) {
+      frame->framebuffer()->CompileDisplayList();
+    }
+    active_ = frame;
+    FrameCanvas *const superseded = updater_->PostLatest(frame);
+    if (superseded != NULL) return superseded;  // Never shown: reuse it.
+    ++frame_pool_releases_due_;
+  }
+  return NextFreeFrame();
+}
+
+FrameCanvas *RGBMatrix::Impl::CreateFrameQueue(int queue_depth) {
+  if (!updater_) return NULL;
+  MutexLock l(&frame_pool_sync_);
+  if (frame_pool_mode_ != kNoFramePool) return NULL;
+  frame_pool_mode_ = kFrameQueue;
+  return CreateFramePool(queue_depth, true);
+}
+
+FrameCanvas *RGBMatrix::Impl::QueueFrame(FrameCanvas *frame,
+                                         int64_t present_at_us) {
+  if (!updater_) return NULL;
+  MutexLock l(&frame_pool_sync_);
+  if (frame_pool_mode_ != kFrameQueue) return NULL;
+  if (frame != NULL) {
+    if (params_.display_list) {
+      frame->framebuffer()->CompileDisplayList();
+    }
+    active_ = frame;
+    updater_->QueueFrame(frame, present_at_us);
+    ++frame_pool_releases_due_;
+  }
+  return NextFreeFrame();
+}
+
+RGBMatrix::FrameQueueStats RGBMatrix::Impl::GetFrameQueueStats() {
+  if (!updater_) return FrameQueueStats();
+  return updater_->GetFrameQueueStats();
+}
+
+RGBMatrix::RefreshStats::RefreshStats()
+  : frames(0), min_frame_us(0), avg_frame_us(0), p99_frame_us(0),
+    max_frame_us(0), last_swap_latency_us(0), max_swap_latency_us(0),
+    frames_held_for_fraction(0), pulse_wait_us(0) {
+  memset(frame_time_histogram, 0, sizeof(frame_time_histogram));
+}
+
+RGBMatrix::RefreshStats RGBMatrix::Impl::GetRefreshStats() {
+  if (!updater_) return RefreshStats();
+  return updater_->GetRefreshStats();
+}
+
+RGBMatrix::PhaseTiming::PhaseTiming() {
+  memset(rows, 0, sizeof(rows));
+  memset(clock_out_ns, 0, sizeof(clock_out_ns));
+  memset(pulse_wait_ns, 0, sizeof(pulse_wait_ns));
+  memset(row_address_ns, 0, sizeof(row_address_ns));
+  memset(strobe_ns, 0, sizeof(strobe_ns));
+  memset(pulse_ns, 0, sizeof(pulse_ns));
+}
+
+RGBMatrix::PhaseTiming RGBMatrix::Impl::GetPhaseTiming() {
+  if (!updater_) return PhaseTiming();
+  return updater_->GetPhaseTiming();
+}
+
+
 uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
   return updater_->AwaitInputChange(timeout_ms);
@@ -564,6 +1247,12 @@ bool RGBMatrix::Impl::luminance_correct() const {
 }
 
 void RGBMatrix::Impl::SetBrightness(uint8_t brightness) {
+  if (params_.pulse_brightness) {
+    brightness = (brightness <= 100 ? (brightness != 0 ? brightness : 1) : 100);
+    params_.brightness = brightness;
+    if (updater_) updater_->SetPulseBrightness(brightness);
+    return;
+  }
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     created_frames_[i]->framebuffer()->SetBrightness(brightness);
   }
@@ -574,6 +1263,60 @@ uint8_t RGBMatrix::Impl::brightness() {
   return params_.brightness;
 }
 
+// Below this many pixels per thread, starting threads to apply a pixel mapper
+// costs more than it saves.
+static const int kMinPixelsPerMapperThread = 16384;
+
+// Visible rows [y_begin, y_end) of a VisibleToMatrix "mapper" from the "from"
+// map to the "to" map.
+static void MapVisibleRows(const PixelMapper *mapper,
+                           PixelDesignatorMap *from, PixelDesignatorMap *to,
+                           int y_begin, int y_end) {
+  const int old_width = from->width();
+  const int old_height = from->height();
+  const int width = to->width();
+  // Batches of rows, so that the coordinates stay in the CPU cache.
+  const int batch_rows = std::max(1, 4096 / width);
+  std::vector<int> orig_x(batch_rows * width), orig_y(batch_rows * width);
+  for (int y0 = y_begin; y0 < y_end; y0 += batch_rows) {
+    const int rows = std::min(batch_rows, y_end - y0);
+    std::fill(orig_x.begin(), orig_x.end(), -1);
+    std::fill(orig_y.begin(), orig_y.end(), -1);
+    mapper->MapVisibleRect(old_width, old_height, 0, y0, width, rows,
+                           orig_x.data(), orig_y.data());
+    for (int i = 0; i < rows * width; ++i) {
+      const int x = i % width, y = y0 + i / width;
+      if (orig_x[i] < 0 || orig_y[i] < 0 ||
+          orig_x[i] >= old_width || orig_y[i] >= old_height) {
+        fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
+                "%dx%d]\n", x, y, orig_x[i], orig_y[i], old_width, old_height);
+        continue;
+      }
+      *to->get(x, y) = *from->get(orig_x[i], orig_y[i]);
+    }
+  }
+}
+
+namespace {
+// Runs MapVisibleRows() for one part of a large display.
+class MapVisibleRowsThread : public Thread {
+public:
+  MapVisibleRowsThread(const PixelMapper *mapper,
+                       PixelDesignatorMap *from, PixelDesignatorMap *to,
+                       int y_begin, int y_end)
+    : mapper_(mapper), from_(from), to_(to), y_begin_(y_begin), y_end_(y_end) {
+  }
+  virtual void Run() { MapVisibleRows(mapper_, from_, to_, y_begin_, y_end_); }
+
+private:
+  const PixelMapper *const mapper_;
+  PixelDesignatorMap *const from_;
+  PixelDesignatorMap *const to_;
+  const int y_begin_;
+  const int y_end_;
+};
+}  // namespace
+
 bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
   if (mapper == NULL) return true;
   using internal::PixelDesignatorMap;
@@ -584,26 +1327,30 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
     return false;
   }
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+    new_width, new_height, shared_pixel_mapper_->GetColorTable());
   switch (mapper->GetMappingType()) {
-    case PixelMapper::VisibleToMatrix:
-      for (int y = 0; y < new_height; ++y) {
-        for (int x = 0; x < new_width; ++x) {
-          int orig_x = -1, orig_y = -1;
-          mapper->MapVisibleToMatrix(old_width, old_height,
-                                     x, y, &orig_x, &orig_y);
-          if (orig_x < 0 || orig_y < 0 ||
-              orig_x >= old_width || orig_y >= old_height) {
-            fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
-                    "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
-            continue;
-          }
-          const internal::PixelDesignator *orig_designator;
-          orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-          *new_mapper->get(x, y) = *orig_designator;
-        }
+    case PixelMapper::VisibleToMatrix: {
+      // Large displays are split into bands of rows mapped in parallel; the
+      // last band is done in this thread.
+      const int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+      const int bands = std::max(1, std::min(
+        cpus, new_width * new_height / kMinPixelsPerMapperThread));
+      std::vector<MapVisibleRowsThread*> threads;
+      for (int b = 0; b < bands - 1; ++b) {
+        threads.push_back(new MapVisibleRowsThread(
+                            mapper, shared_pixel_mapper_, new_mapper,
+                            b * new_height / bands,
+                            (b + 1) * new_height / bands));
+        threads.back()->Start();
+      }
+      MapVisibleRows(mapper, shared_pixel_mapper_, new_mapper,
+                     (bands - 1) * new_height / bands, new_height);
+      for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->WaitStopped();
+        delete threads[i];
       }
       break;
+    }
     case PixelMapper::MatrixToVisible: {
       bool collision_reported = false;
       for (int y = 0; y < old_height; ++y) {
@@ -697,8 +1444,9 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
   }
 
   static GPIO io;  // This static var is a little bit icky.
-  if (runtime_options.do_gpio_init
-      && !io.Init(runtime_options.gpio_slowdown)) {
+  const bool do_gpio_init = runtime_options.do_gpio_init
+    && runtime_options.gpio_recorder == NULL;
+  if (do_gpio_init && !io.Init(runtime_options.gpio_slowdown)) {
     fprintf(stderr, "Must run as root to be able to access /dev/mem\n"
             "Prepend 'sudo' to the command\n");
     return NULL;
@@ -708,11 +1456,46 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
     perror("Failed to become daemon");
   }
 
-  RGBMatrix::Impl *result = new RGBMatrix::Impl(NULL, options);
+  if (runtime_options.sleep_jitter_file
+      && !WriteSleepJitterOnSignal(runtime_options.sleep_jitter_file)) {
+    return NULL;
+  }
+
+  if (runtime_options.refresh_cpu < -1 || runtime_options.refresh_cpu > 31) {
+    fprintf(stderr, "--led-refresh-cpu=%d is outside usable range\n",
+            runtime_options.refresh_cpu);
+    return NULL;
+  }
+  if (runtime_options.refresh_priority < 0
+      || runtime_options.refresh_priority > 99) {
+    fprintf(stderr, "--led-refresh-priority=%d is outside usable range "
+            "(0..99)\n", runtime_options.refresh_priority);
+    return NULL;
+  }
+  int refresh_policy;
+  if (runtime_options.refresh_policy == NULL
+      || strcasecmp(runtime_options.refresh_policy, "fifo") == 0) {
+    refresh_policy = SCHED_FIFO;
+  } else if (strcasecmp(runtime_options.refresh_policy, "rr") == 0) {
+    refresh_policy = SCHED_RR;
+  } else {
+    fprintf(stderr, "--led-refresh-policy=%s: expected 'fifo' or 'rr'\n",
+            runtime_options.refresh_policy);
+    return NULL;
+  }
+
+  RGBMatrix::Impl *result = new RGBMatrix::Impl(NULL, options,
+                                                runtime_options.pixel_mapping_cache);
+  result->SetRefreshScheduling(runtime_options.refresh_cpu, refresh_policy,
+                               runtime_options.refresh_priority);
   // Allowing daemon also means we are allowed to start the thread now.
   const bool allow_daemon = !(runtime_options.daemon < 0);
-  if (runtime_options.do_gpio_init)
+  if (runtime_options.gpio_recorder) {
+    result->recording_io_.InitRecording(runtime_options.gpio_recorder);
+    result->SetGPIO(&result->recording_io_, allow_daemon);
+  } else if (do_gpio_init) {
     result->SetGPIO(&io, allow_daemon);
+  }
 
   // TODO(hzeller): if we disallow daemon, then we might also disallow
   // drop privileges: we can't drop privileges until we have created the
@@ -749,6 +1532,43 @@ FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned framerate_fraction) {
   return impl_->SwapOnVSync(other, framerate_fraction);
 }
+FrameCanvas *RGBMatrix::CreateMailbox(int queue_depth) {
+  return impl_->CreateMailbox(queue_depth);
+}
+FrameCanvas *RGBMatrix::SwapLatest(FrameCanvas *frame) {
+  return impl_->SwapLatest(frame);
+}
+FrameCanvas *RGBMatrix::CreateFrameQueue(int queue_depth) {
+  return impl_->CreateFrameQueue(queue_depth);
+}
+FrameCanvas *RGBMatrix::QueueFrame(FrameCanvas *frame, int64_t present_at_us) {
+  return impl_->QueueFrame(frame, present_at_us);
+}
+RGBMatrix::FrameQueueStats RGBMatrix::GetFrameQueueStats() {
+  return impl_->GetFrameQueueStats();
+}
+RGBMatrix::RefreshStats RGBMatrix::GetRefreshStats() {
+  return impl_->GetRefreshStats();
+}
+RGBMatrix::PhaseTiming RGBMatrix::GetPhaseTiming() {
+  return impl_->GetPhaseTiming();
+}
+
+RGBMatrix::SleepJitter::SleepJitter() : allowance_us(0) {
+  memset(overshoot_us, 0, sizeof(overshoot_us));
+}
+
+void RGBMatrix::SetSleepJitterRecording(bool enable) {
+  rgb_matrix::SetSleepJitterRecording(enable);
+}
+
+RGBMatrix::SleepJitter RGBMatrix::GetSleepJitter() {
+  static_assert(SleepJitter::kBuckets == kSleepJitterBuckets,
+                "Keep SleepJitter in sync with gpio.h");
+  SleepJitter result;
+  result.allowance_us = GetSleepJitterHistogram(result.overshoot_us);
+  return result;
+}
 bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
   return impl_->ApplyPixelMapper(mapper);
 }
@@ -794,6 +1614,11 @@ void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
   impl_->active_->SetPixel(x, y, red, green, blue);
 }
 
+void RGBMatrix::SetPixels(int x, int y, int width, int height,
+                          const Color *colors) {
+  impl_->active_->SetPixels(x, y, width, height, colors);
+}
+
 void RGBMatrix::Clear() {
   impl_->active_->Clear();
 }
@@ -802,6 +1627,11 @@ void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   impl_->active_->Fill(red, green, blue);
 }
 
+void RGBMatrix::SubFill(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->SubFill(x, y, width, height, red, green, blue);
+}
+
 // FrameCanvas implementation of Canvas
 FrameCanvas::~FrameCanvas() { delete frame_; }
 int FrameCanvas::width() const { return frame_->width(); }
@@ -811,7 +1641,7 @@ void FrameCanvas::SetPixel(int x, int y,
   frame_->SetPixel(x, y, red, green, blue);
 }
 void FrameCanvas::SetPixels(int x, int y, int width, int height,
-                         Color *colors) {
+                         const Color *colors) {
   frame_->SetPixels(x, y, width, height, colors);
 }
 void FrameCanvas::Clear() { return frame_->Clear(); }
@@ -821,6 +1651,9 @@ void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
 void FrameCanvas::SubFill(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue) {
   frame_->SubFill(x, y, width, height, red, green, blue);
 }
+void FrameCanvas::SetFromRGBBuffer(const uint8_t *rgb, int stride) {
+  frame_->SetFromRGBBuffer(rgb, stride);
+}
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
 
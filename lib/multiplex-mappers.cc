@@ -59,12 +59,42 @@ public:
     const int within_panel_x = visible_x % panel_cols_;
     const int within_panel_y = visible_y % panel_rows_;
 
-    int new_x, new_y;
+    int new_x = -1, new_y = -1;  // Not all mappers handle all panel sizes.
     MapSinglePanel(within_panel_x, within_panel_y, &new_x, &new_y);
+    if (new_x < 0 || new_y < 0) {
+      // Unmapped; must stay invalid, not land on the neighbouring panel.
+      *matrix_x = *matrix_y = -1;
+      return;
+    }
     *matrix_x = chained_panel  * panel_stretch_factor_*panel_cols_ + new_x;
     *matrix_y = parallel_panel * panel_rows_/panel_stretch_factor_ + new_y;
   }
 
+  // Same for a row, walking along the panels instead of dividing per pixel.
+  virtual void MapVisibleRow(int matrix_width, int matrix_height,
+                             int visible_x, int visible_y, int count,
+                             int *matrix_x, int *matrix_y) const {
+    const int parallel_panel = visible_y / panel_rows_;
+    const int within_panel_y = visible_y % panel_rows_;
+    const int y_offset = parallel_panel * panel_rows_/panel_stretch_factor_;
+    int chained_panel = visible_x / panel_cols_;
+    int within_panel_x = visible_x % panel_cols_;
+    for (int i = 0; i < count; ++i) {
+      int new_x = -1, new_y = -1;
+      MapSinglePanel(within_panel_x, within_panel_y, &new_x, &new_y);
+      if (new_x < 0 || new_y < 0) {
+        matrix_x[i] = matrix_y[i] = -1;
+      } else {
+        matrix_x[i] = chained_panel * panel_stretch_factor_*panel_cols_ + new_x;
+        matrix_y[i] = y_offset + new_y;
+      }
+      if (++within_panel_x == panel_cols_) {
+        within_panel_x = 0;
+        ++chained_panel;
+      }
+    }
+  }
+
   // Map the coordinates for a single panel. This is to be overridden in
   // derived classes.
   // Input parameter is the visible position on the matrix, and this method
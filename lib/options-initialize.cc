@@ -41,7 +41,13 @@ RuntimeOptions::RuntimeOptions() :
   drop_privileges(1),   // Encourage good practice: drop privileges by default.
   do_gpio_init(true),
   drop_priv_user("daemon"),
-  drop_priv_group("daemon")
+  drop_priv_group("daemon"),
+  sleep_jitter_file(NULL),
+  refresh_cpu(-1),
+  refresh_priority(99),
+  refresh_policy("fifo"),
+  gpio_recorder(NULL),
+  pixel_mapping_cache(NULL)
 {
   // Nothing to see here.
 }
@@ -190,6 +196,14 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("pulse-brightness", it, &mopts->pulse_brightness))
+        continue;
+      if (ConsumeBoolFlag("display-list", it, &mopts->display_list))
+        continue;
+      if (ConsumeBoolFlag("phase-timing", it, &mopts->phase_timing))
+        continue;
+      if (ConsumeBoolFlag("sched-deadline", it, &mopts->sched_deadline))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -242,6 +256,23 @@ static bool FlagInit(int &argc, char **&argv,
                             &ropts->drop_priv_group, &err)) {
         continue;
       }
+      if (ConsumeStringFlag("sleep-jitter-file", it, end,
+                            &ropts->sleep_jitter_file, &err)) {
+        continue;
+      }
+      if (ConsumeStringFlag("pixel-mapping-cache", it, end,
+                            &ropts->pixel_mapping_cache, &err)) {
+        continue;
+      }
+      if (ConsumeIntFlag("refresh-cpu", it, end, &ropts->refresh_cpu, &err))
+        continue;
+      if (ConsumeIntFlag("refresh-priority", it, end,
+                         &ropts->refresh_priority, &err))
+        continue;
+      if (ConsumeStringFlag("refresh-policy", it, end,
+                            &ropts->refresh_policy, &err)) {
+        continue;
+      }
 
       if (strncmp(*it, OPTION_PREFIX, OPTION_PREFIX_LEN) == 0) {
         fprintf(stderr, "Option %s starts with %s but it is unknown. Typo?\n",
@@ -328,13 +359,19 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t                            Available: %s. Default: \"\"\n"
           "\t--led-pwm-bits=<1..%d>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
+          "\t--led-%spulse-brightness    : %sim by shortening LED on-time "
+          "instead of changing colors.\n"
           "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
           "(Default: %d).\n"
           "\t--led-row-addr-type=<0..4>: 0 = default; 1 = AB-addressed panels; 2 = direct row select; 3 = ABC-addressed panels; 4 = ABC Shift + DE direct "
           "(Default: 0).\n"
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
+          "\t--led-%sphase-timing        : %srint time per bitplane and "
+          "phase on exit.\n"
           "\t--led-limit-refresh=<Hz>  : Limit refresh rate to this frequency in Hz. Useful to keep a\n"
           "\t                            constant refresh rate on loaded system. 0=no limit. Default: %d\n"
+          "\t--led-%ssched-deadline     : %set the kernel pace limited refresh "
+          "with SCHED_DEADLINE.\n"
           "\t--led-%sinverse             "
           ": Switch if your matrix has inverse colors %s.\n"
           "\t--led-rgb-sequence        : Switch if your matrix has led colors "
@@ -344,6 +381,8 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
           "(Default: 0)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
+          "\t--led-%sdisplay-list     : %srecompile swapped frames into GPIO "
+          "writes.\n"
           "\t--led-panel-type=<name>   : Needed to initialize special panels. Supported: 'FM6126A', 'FM6127'\n"
           "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n",
           d.hardware_mapping,
@@ -351,13 +390,18 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
           internal::Framebuffer::kBitPlanes, d.pwm_bits,
-          d.brightness, d.scan_mode,
+          d.brightness,
+          d.pulse_brightness ? "no-" : "", d.pulse_brightness ? "Don't d" : "D",
+          d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
+          d.phase_timing ? "no-" : "", d.phase_timing ? "Don't p" : "P",
           d.limit_refresh_rate_hz,
+          d.sched_deadline ? "no-" : "", d.sched_deadline ? "Don't l" : "L",
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U",
+          d.display_list ? "no-" : "", d.display_list ? "Don't p" : "P",
           !d.disable_busy_waiting ? "no-" : "",
           !d.disable_busy_waiting ? "Don't u" : "U");
 
@@ -388,6 +432,18 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
             "Drop privileges to this groupname or GID (Default: '%s')\n",
             r.drop_priv_group);
   }
+  fprintf(out, "\t--led-sleep-jitter-file=<file>: "
+          "Record nanosleep() jitter; write histogram to file on SIGUSR1.\n");
+  fprintf(out, "\t--led-pixel-mapping-cache=<dir>: "
+          "Keep the composed pixel mapping in this directory for faster "
+          "starts.\n");
+  fprintf(out, "\t--led-refresh-cpu=<cpu>   : CPU to refresh the matrix on "
+          "(Default: isolated CPU, else last).\n"
+          "\t--led-refresh-priority=<0..99>: Realtime priority of the "
+          "refresh thread; 0 = none (Default: %d).\n"
+          "\t--led-refresh-policy=<fifo|rr>: Realtime scheduling policy "
+          "of the refresh thread (Default: %s).\n",
+          r.refresh_priority, r.refresh_policy);
 }
 
 bool RGBMatrix::Options::Validate(std::string *err_in) const {
@@ -467,6 +523,11 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (sched_deadline && limit_refresh_rate_hz <= 0) {
+    err->append("sched-deadline needs a refresh rate limit (limit-refresh).\n");
+    success = false;
+  }
+
   if (led_rgb_sequence == NULL || strlen(led_rgb_sequence) != 3) {
     err->append("led-sequence needs to be three characters long.\n");
     success = false;
@@ -0,0 +1,278 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "panel-emulator.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "framebuffer-internal.h"
+#include "multiplex-mappers-internal.h"
+
+#ifdef ONLY_SINGLE_SUB_PANEL
+#  define SUB_PANELS_ 1
+#else
+#  define SUB_PANELS_ 2
+#endif
+
+namespace rgb_matrix {
+using namespace internal;
+
+class PanelEmulator::Impl {
+public:
+  Impl(const RGBMatrix::Options &options);
+
+  void Write(int64_t time_ns, gpio_bits_t clear_bits, gpio_bits_t set_bits);
+  void Reset();
+  void GetImage(std::vector<float> *rgb) const;
+
+  int width() const { return columns_; }
+  int height() const { return rows_ * parallel_; }
+
+private:
+  // Add the light of the lit LEDs from the last write up to "time_ns".
+  void CollectLight(int64_t time_ns);
+
+  // Bitmask of the double rows currently selected by the row address.
+  uint32_t SelectedRows() const;
+
+  // Row address types that shift the selected row(s) in on a clock.
+  void ShiftRowRegister(gpio_bits_t rising);
+
+  int row_address_type_;
+  int rows_;
+  int columns_;
+  int parallel_;
+  int double_rows_;
+  uint32_t all_rows_;
+  bool inverse_colors_;
+
+  gpio_bits_t output_enable_, clock_, strobe_;
+  gpio_bits_t a_, b_, c_, d_, e_;
+  // The pins that light red, green and blue for each chain and sub-panel.
+  gpio_bits_t color_pins_[6][SUB_PANELS_][3];
+
+  gpio_bits_t pins_;                  // Current level of all outputs.
+  std::vector<gpio_bits_t> shifted_;  // Ring of the last columns_ clocks.
+  int shift_pos_;
+  std::vector<gpio_bits_t> latched_;  // Column 0 is the first clocked in.
+  uint64_t row_register_;
+
+  int64_t last_time_ns_;
+  std::vector<uint64_t> lit_ns_;       // Per pixel and color.
+  std::vector<uint64_t> row_shown_ns_; // Per double row.
+};
+
+PanelEmulator::Impl::Impl(const RGBMatrix::Options &options)
+  : row_address_type_(options.row_address_type),
+    rows_(options.rows), columns_(options.cols),
+    parallel_(options.parallel),
+    inverse_colors_(options.inverse_colors),
+    pins_(0), shift_pos_(0), last_time_ns_(0) {
+  // Same geometry as the RGBMatrix sends out.
+  if (options.multiplexing > 0) {
+    const MuxMapperList &multiplexers = GetRegisteredMultiplexMappers();
+    if (options.multiplexing <= (int) multiplexers.size()) {
+      multiplexers[options.multiplexing - 1]->EditColsRows(&columns_, &rows_);
+    }
+  }
+  columns_ *= options.chain_length;
+  double_rows_ = rows_ / SUB_PANELS_;
+  all_rows_ = double_rows_ >= 32 ? ~0u : (1u << double_rows_) - 1;
+
+  MatrixHardware hardware;
+  hardware.InitHardwareMapping(options.hardware_mapping);
+  const HardwareMapping &h = hardware.mapping();
+  output_enable_ = h.output_enable;
+  clock_ = h.clock;
+  strobe_ = h.strobe;
+  a_ = h.a; b_ = h.b; c_ = h.c; d_ = h.d; e_ = h.e;
+
+  const gpio_bits_t pins[6][2][3] = {
+    { { h.p0_r1, h.p0_g1, h.p0_b1 }, { h.p0_r2, h.p0_g2, h.p0_b2 } },
+    { { h.p1_r1, h.p1_g1, h.p1_b1 }, { h.p1_r2, h.p1_g2, h.p1_b2 } },
+    { { h.p2_r1, h.p2_g1, h.p2_b1 }, { h.p2_r2, h.p2_g2, h.p2_b2 } },
+    { { h.p3_r1, h.p3_g1, h.p3_b1 }, { h.p3_r2, h.p3_g2, h.p3_b2 } },
+    { { h.p4_r1, h.p4_g1, h.p4_b1 }, { h.p4_r2, h.p4_g2, h.p4_b2 } },
+    { { h.p5_r1, h.p5_g1, h.p5_b1 }, { h.p5_r2, h.p5_g2, h.p5_b2 } },
+  };
+  // With a different --led-rgb-sequence, the panel lights the color at the
+  // position of the pin in the sequence.
+  const char *sequence = options.led_rgb_sequence ? options.led_rgb_sequence
+    : "RGB";
+  const char kColors[] = "RGB";
+  for (int color = 0; color < 3; ++color) {
+    const char *pos = strchr(sequence, kColors[color]);
+    if (pos == NULL) pos = strchr(sequence, tolower(kColors[color]));
+    const int pin = (pos == NULL || pos - sequence > 2) ? color
+      : pos - sequence;
+    for (int p = 0; p < 6; ++p) {
+      for (int sub = 0; sub < SUB_PANELS_; ++sub) {
+        color_pins_[p][sub][color] = pins[p][sub][pin];
+      }
+    }
+  }
+
+  // Shift register row addressing with active-low outputs starts all off.
+  row_register_ = (row_address_type_ == 1) ? ~0ull : 0;
+
+  shifted_.resize(columns_);
+  latched_.resize(columns_);
+  lit_ns_.resize(height() * width() * 3);
+  row_shown_ns_.resize(double_rows_);
+}
+
+uint32_t PanelEmulator::Impl::SelectedRows() const {
+  switch (row_address_type_) {
+  case 0: {  // Address lines A..E.
+    int row = (pins_ & a_) ? 1 : 0;
+    if (double_rows_ > 2 && (pins_ & b_)) row |= 2;
+    if (double_rows_ > 4 && (pins_ & c_)) row |= 4;
+    if (double_rows_ > 8 && (pins_ & d_)) row |= 8;
+    if (double_rows_ > 16 && (pins_ & e_)) row |= 16;
+    return (1u << row) & all_rows_;
+  }
+  case 1:  // Active low; the extra clock leaves the newest bit unused.
+    return ~(uint32_t)(row_register_ >> 1) & all_rows_;
+  case 2: {  // One low line of A..D per row.
+    const gpio_bits_t lines[4] = { a_, b_, c_, d_ };
+    uint32_t result = 0;
+    for (int row = 0; row < double_rows_; ++row) {
+      if ((pins_ & lines[row % 4]) == 0) result |= 1u << row;
+    }
+    return result;
+  }
+  case 4: {  // Eight rows from the shifter, D and E select the group.
+    int group = 0;
+    if (double_rows_ > 8 && (pins_ & d_)) group |= 1;
+    if (double_rows_ > 16 && (pins_ & e_)) group |= 2;
+    return ((uint32_t)(row_register_ & 0xff) << (8 * group)) & all_rows_;
+  }
+  default:  // Active high shift registers.
+    return (uint32_t)row_register_ & all_rows_;
+  }
+}
+
+void PanelEmulator::Impl::ShiftRowRegister(gpio_bits_t rising) {
+  gpio_bits_t clock = 0, data = 0, enable = 0;
+  int length = double_rows_;
+  switch (row_address_type_) {
+  case 1: clock = a_; data = b_; length = double_rows_ + 1; break;
+  case 3: clock = a_; data = c_; break;
+  case 4: clock = a_; data = b_; enable = c_; length = 8; break;
+  case 5: clock = a_; data = c_; enable = b_; break;
+  default: return;
+  }
+  if ((rising & clock) == 0) return;
+  if (enable && (pins_ & enable) == 0) return;
+  row_register_ = (row_register_ << 1) | ((pins_ & data) ? 1 : 0);
+  if (length < 64) row_register_ &= (1ull << length) - 1;
+}
+
+void PanelEmulator::Impl::CollectLight(int64_t time_ns) {
+  const int64_t duration = time_ns - last_time_ns_;
+  last_time_ns_ = time_ns;
+  if (duration <= 0 || (pins_ & output_enable_) != 0)
+    return;  // Output enable is active low.
+  const uint32_t rows = SelectedRows();
+  for (int row = 0; row < double_rows_; ++row) {
+    if ((rows & (1u << row)) == 0) continue;
+    row_shown_ns_[row] += duration;
+    for (int p = 0; p < parallel_; ++p) {
+      for (int sub = 0; sub < SUB_PANELS_; ++sub) {
+        const int y = p * rows_ + sub * double_rows_ + row;
+        uint64_t *lit = &lit_ns_[y * columns_ * 3];
+        const gpio_bits_t *const color_pins = color_pins_[p][sub];
+        for (int x = 0; x < columns_; ++x, lit += 3) {
+          const gpio_bits_t value = inverse_colors_ ? ~latched_[x]
+            : latched_[x];
+          for (int color = 0; color < 3; ++color) {
+            if (value & color_pins[color]) lit[color] += duration;
+          }
+        }
+      }
+    }
+  }
+}
+
+void PanelEmulator::Impl::Write(int64_t time_ns,
+                                gpio_bits_t clear_bits, gpio_bits_t set_bits) {
+  CollectLight(time_ns);
+  const gpio_bits_t before = pins_;
+  pins_ = (pins_ & ~clear_bits) | set_bits;
+  const gpio_bits_t rising = pins_ & ~before;
+  if (rising & clock_) {
+    shifted_[shift_pos_] = pins_;
+    if (++shift_pos_ == columns_) shift_pos_ = 0;
+  }
+  if (rising & strobe_) {
+    for (int x = 0; x < columns_; ++x) {
+      latched_[x] = shifted_[(shift_pos_ + x) % columns_];
+    }
+  }
+  ShiftRowRegister(rising);
+}
+
+void PanelEmulator::Impl::Reset() {
+  std::fill(lit_ns_.begin(), lit_ns_.end(), 0);
+  std::fill(row_shown_ns_.begin(), row_shown_ns_.end(), 0);
+}
+
+void PanelEmulator::Impl::GetImage(std::vector<float> *rgb) const {
+  rgb->resize(lit_ns_.size());
+  for (int y = 0; y < height(); ++y) {
+    const uint64_t shown = row_shown_ns_[(y % rows_) % double_rows_];
+    for (int i = y * columns_ * 3; i < (y + 1) * columns_ * 3; ++i) {
+      (*rgb)[i] = shown ? (float)lit_ns_[i] / shown : 0.0f;
+    }
+  }
+}
+
+PanelEmulator::PanelEmulator(const RGBMatrix::Options &options, int write_ns)
+  : GPIORecorder(write_ns), impl_(new Impl(options)) {
+}
+
+PanelEmulator::~PanelEmulator() {
+  delete impl_;
+}
+
+int PanelEmulator::width() const { return impl_->width(); }
+int PanelEmulator::height() const { return impl_->height(); }
+
+void PanelEmulator::Replay(const std::vector<GPIOTrace::Event> &events) {
+  MutexLock l(&mutex_);
+  for (size_t i = 0; i < events.size(); ++i) {
+    impl_->Write(events[i].time_ns, events[i].clear_bits, events[i].set_bits);
+  }
+}
+
+void PanelEmulator::Reset() {
+  MutexLock l(&mutex_);
+  impl_->Reset();
+}
+
+void PanelEmulator::GetImage(std::vector<float> *rgb) const {
+  MutexLock l(&mutex_);
+  impl_->GetImage(rgb);
+}
+
+void PanelEmulator::Write(int64_t time_ns,
+                          uint64_t clear_bits, uint64_t set_bits) {
+  MutexLock l(&mutex_);
+  impl_->Write(time_ns, clear_bits, set_bits);
+}
+}  // namespace rgb_matrix
@@ -307,6 +307,7 @@ public:
       fprintf(stderr, "expected '|' after height parameter ('%s')\n", param);
       return false;
     }
+    map_.clear();  // The registered mapper is reused by FindPixelMapper().
     while(*pos) {
       MapTile tile;
       if ((pos = tile.ParseParam(pos)) == NULL)
@@ -0,0 +1,64 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_PIXEL_MAPPING_CACHE_INTERNAL_H
+#define RPI_PIXEL_MAPPING_CACHE_INTERNAL_H
+
+#include <string>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+namespace internal {
+class Framebuffer;
+class PixelDesignatorMap;
+struct PixelColorTable;
+
+// Keeps the pixel mapping composed from the multiplexer and the
+// --led-pixel-mapper list in a file, so that the next start with the same
+// configuration can skip applying all the mappers; for large displays with
+// Remap configurations that is a noticeable part of the startup time.
+//
+// There is one file per configuration in the cache directory, named after
+// a hash of everything that influences the mapping. The file also holds the
+// full configuration and a format version, so a file of another
+// configuration is never used. Changes of the mappers themselves are only
+// covered by the mapping version in pixel-mapping-cache.cc for the mappers
+// of this library; pixel mappers registered by the application are known by
+// name only, so the cache directory needs to be cleared when they change.
+class PixelMappingCache {
+public:
+  // Cache in "directory"; with NULL, Load() and Store() do nothing.
+  // "hardware_name" is the name of the GPIO mapping in use.
+  PixelMappingCache(const char *directory, const RGBMatrix::Options &options,
+                    const char *hardware_name);
+
+  // Return a mapping for "framebuffer" with the given colors, or NULL if
+  // there is no usable cached one.
+  PixelDesignatorMap *Load(const Framebuffer &framebuffer,
+                           const PixelColorTable &colors) const;
+
+  // Store "map" for the next start. Returns false, with a message, if the
+  // file could not be written.
+  bool Store(const PixelDesignatorMap &map) const;
+
+private:
+  std::string key_;       // Full configuration.
+  std::string filename_;  // Empty if not caching.
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_PIXEL_MAPPING_CACHE_INTERNAL_H
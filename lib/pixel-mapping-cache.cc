@@ -0,0 +1,183 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "pixel-mapping-cache-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framebuffer-internal.h"
+
+namespace rgb_matrix {
+namespace internal {
+// Bump when the file layout or the meaning of PixelDesignator changes.
+static const uint32_t kFileVersion = 1;
+// Bump when a multiplexer or one of the built-in pixel mappers changes the
+// mapping it produces, so that files from older builds are not used anymore.
+static const uint32_t kMappingVersion = 2;
+static const char kFileMagic[8] = "RGBMAP\n";
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_length;  // Followed by the key itself, ...
+  int32_t width;        // ... then width * height PixelDesignators.
+  int32_t height;
+};
+
+static uint64_t Fnv1aHash(const std::string &s) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < s.size(); ++i) {
+    hash = (hash ^ (uint8_t)s[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static const char *OrEmpty(const char *s) { return s ? s : ""; }
+
+PixelMappingCache::PixelMappingCache(const char *directory,
+                                     const RGBMatrix::Options &options,
+                                     const char *hardware_name) {
+  if (directory == NULL || *directory == '\0')
+    return;
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "rows=%d cols=%d chain=%d parallel=%d multiplexing=%d "
+           "designator=%d planes=%d mapping-version=%u",
+           options.rows, options.cols, options.chain_length, options.parallel,
+           options.multiplexing, (int)sizeof(PixelDesignator),
+           Framebuffer::kBitPlanes, kMappingVersion);
+  key_ = buffer;
+  key_.append(" hardware=").append(OrEmpty(hardware_name));
+  key_.append(" sequence=").append(OrEmpty(options.led_rgb_sequence));
+  key_.append(" mapper=").append(OrEmpty(options.pixel_mapper_config));
+#ifdef ONLY_SINGLE_SUB_PANEL
+  key_.append(" single-sub-panel");
+#endif
+
+  snprintf(buffer, sizeof(buffer), "/pixel-mapping-%016llx.map",
+           (unsigned long long)Fnv1aHash(key_));
+  filename_ = directory;
+  filename_.append(buffer);
+}
+
+PixelDesignatorMap *PixelMappingCache::Load(const Framebuffer &framebuffer,
+                                            const PixelColorTable &colors)
+  const {
+  if (filename_.empty())
+    return NULL;
+  const int fd = open(filename_.c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;  // Not cached yet.
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FileHeader)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  const char *const bytes = (const char*) data;
+  const FileHeader *header = (const FileHeader*) bytes;
+  const size_t designators_start = sizeof(FileHeader) + key_.size();
+  // The size has to be right before looking at the key: a truncated file
+  // would otherwise be read beyond the end of the mapping. Width and height
+  // are checked by division first, so that bogus values can't overflow.
+  bool usable
+    = (memcmp(header->magic, kFileMagic, sizeof(kFileMagic)) == 0
+       && header->version == kFileVersion
+       && header->key_length == key_.size()
+       && header->width > 0 && header->height > 0
+       && (size_t)st.st_size >= designators_start
+       && ((size_t)st.st_size - designators_start) / sizeof(PixelDesignator)
+       / header->width == (size_t)header->height
+       && (size_t)st.st_size == designators_start
+       + (size_t)header->width * header->height * sizeof(PixelDesignator)
+       && memcmp(bytes + sizeof(FileHeader), key_.data(), key_.size()) == 0);
+
+  // The designators are copied one by one: they might not be aligned in
+  // the file, and every one of them is checked to be within the framebuffer.
+  PixelDesignatorMap *map = NULL;
+  if (usable) {
+    map = new PixelDesignatorMap(header->width, header->height, colors);
+    const char *from = bytes + designators_start;
+    for (int y = 0; usable && y < header->height; ++y) {
+      for (int x = 0; usable && x < header->width; ++x) {
+        PixelDesignator *d = map->get(x, y);
+        memcpy(d, from, sizeof(*d));
+        from += sizeof(*d);
+        usable = framebuffer.IsValid(*d);
+      }
+    }
+    if (!usable) {
+      fprintf(stderr, "%s: invalid pixel mapping, ignored.\n",
+              filename_.c_str());
+      delete map;
+      map = NULL;
+    }
+  }
+  munmap(data, st.st_size);
+  return map;
+}
+
+bool PixelMappingCache::Store(const PixelDesignatorMap &const_map) const {
+  if (filename_.empty())
+    return true;
+  PixelDesignatorMap &map = const_cast<PixelDesignatorMap&>(const_map);
+  FileHeader header;
+  memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+  header.version = kFileVersion;
+  header.key_length = key_.size();
+  header.width = map.width();
+  header.height = map.height();
+  std::string content((const char*) &header, sizeof(header));
+  content.append(key_);
+  for (int y = 0; y < map.height(); ++y) {
+    for (int x = 0; x < map.width(); ++x) {
+      content.append((const char*) map.get(x, y), sizeof(PixelDesignator));
+    }
+  }
+
+  // Write a temporary file first, so that another process starting at the
+  // same time never sees a partial file.
+  char pid_suffix[32];
+  snprintf(pid_suffix, sizeof(pid_suffix), ".%d", (int)getpid());
+  const std::string tmp_filename = filename_ + pid_suffix;
+  const int fd = open(tmp_filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Can't cache pixel mapping in %s: %s\n",
+            tmp_filename.c_str(), strerror(errno));
+    return false;
+  }
+  bool success = write(fd, content.data(), content.size())
+    == (ssize_t) content.size();
+  success &= (close(fd) == 0);
+  success = success && rename(tmp_filename.c_str(), filename_.c_str()) == 0;
+  if (!success) {
+    fprintf(stderr, "Can't cache pixel mapping in %s: %s\n",
+            filename_.c_str(), strerror(errno));
+    unlink(tmp_filename.c_str());
+  }
+  return success;
+}
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -21,8 +21,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 namespace rgb_matrix {
+static uint32_t sAvoidedCPUs = 0;
+
 void *Thread::PthreadCallRun(void *tobject) {
   reinterpret_cast<Thread*>(tobject)->Run();
   return NULL;
@@ -42,15 +45,24 @@ void Thread::WaitStopped() {
   started_ = false;
 }
 
+void Thread::SetAvoidedCPUs(uint32_t cpu_mask) {
+  sAvoidedCPUs = cpu_mask;
+}
+
 void Thread::Start(int priority, uint32_t affinity_mask) {
+  StartWithPolicy(SCHED_FIFO, priority, affinity_mask);
+}
+
+void Thread::StartWithPolicy(int policy, int priority,
+                             uint32_t affinity_mask, bool avoid_cpus) {
   assert(!started_);  // Did you call WaitStopped() ?
   pthread_create(&thread_, NULL, &PthreadCallRun, this);
   int err;
 
-  if (priority > 0) {
+  if (priority > 0 && policy != SCHED_OTHER) {
     struct sched_param p;
     p.sched_priority = priority;
-    if ((err = pthread_setschedparam(thread_, SCHED_FIFO, &p))) {
+    if ((err = pthread_setschedparam(thread_, policy, &p))) {
       char buffer[PATH_MAX];
       const char *bin = realpath("/proc/self/exe", buffer);  // Linux specific.
       fprintf(stderr, "Can't set realtime thread priority=%d: %s.\n"
@@ -76,23 +88,68 @@ void Thread::Start(int priority, uint32_t affinity_mask) {
       // On a Pi1, this won't work as there is only one core. Don't worry in
       // that case.
     }
+  } else if (avoid_cpus && sAvoidedCPUs != 0) {
+    cpu_set_t cpu_mask;
+    if (pthread_getaffinity_np(thread_, sizeof(cpu_mask), &cpu_mask) == 0) {
+      for (int i = 0; i < 32; ++i) {
+        if ((sAvoidedCPUs & (1u<<i)) != 0) {
+          CPU_CLR(i, &cpu_mask);
+        }
+      }
+      if (CPU_COUNT(&cpu_mask) > 0) {  // Else, there is nothing left.
+        pthread_setaffinity_np(thread_, sizeof(cpu_mask), &cpu_mask);
+      }
+    }
   }
 
   started_ = true;
 }
 
+ConditionVariable::ConditionVariable() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond_, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+Mutex::Mutex() {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  // If not supported, this stays a plain mutex; it just lacks the protection
+  // against priority inversion then.
+  pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&mutex_, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// Absolute time "timeout_ms" from now on "clock".
+static struct timespec DeadlineIn(clockid_t clock, long timeout_ms) {
+  struct timespec t;
+  clock_gettime(clock, &t);
+  t.tv_sec += timeout_ms / 1000;
+  t.tv_nsec += (timeout_ms % 1000) * 1000000;
+  t.tv_sec += t.tv_nsec / 1000000000;
+  t.tv_nsec %= 1000000000;
+  return t;
+}
+
+bool Mutex::WaitOn(ConditionVariable *cond, long timeout_ms) {
+  if (timeout_ms < 0) {
+    pthread_cond_wait(&cond->cond_, &mutex_);
+    return true;
+  }
+  const struct timespec t = DeadlineIn(CLOCK_MONOTONIC, timeout_ms);
+  return pthread_cond_timedwait(&cond->cond_, &mutex_, &t) == 0;
+}
+
 bool Mutex::WaitOn(pthread_cond_t *cond, long timeout_ms) {
   if (timeout_ms < 0) {
     pthread_cond_wait(cond, &mutex_);
     return true;
   }
   else {
-    struct timespec t;
-    clock_gettime(CLOCK_REALTIME, &t);
-    t.tv_sec += timeout_ms / 1000;
-    t.tv_nsec += (timeout_ms % 1000) * 1000000;
-    t.tv_sec += t.tv_nsec / 1000000000;
-    t.tv_nsec %= 1000000000;
+    const struct timespec t = DeadlineIn(CLOCK_REALTIME, timeout_ms);
     // TODO(hzeller): It doesn't seem we return with EINTR on signal. We should.
     return pthread_cond_timedwait(cond, &mutex_, &t) == 0;
   }
@@ -0,0 +1,280 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Show an image or a test pattern on emulated panels and write what they
+// would display, without any hardware. Useful to check a combination of
+// --led-multiplexing, --led-scan-mode, --led-row-addr-type etc.
+
+#include "led-matrix.h"
+#include "panel-emulator.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [<image.ppm>]\n", progname);
+  fprintf(stderr, "Shows the binary PPM image, or a test pattern, on "
+          "emulated panels and writes\nwhat they would display.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-o <file.ppm>     : Write the emulated panels to this file. With "
+          "-n > 1, a\n"
+          "\t                    printf pattern for the image number, e.g. "
+          "out-%%03d.ppm\n"
+          "\t-t                : Show the emulated panels in the terminal "
+          "(24 bit color).\n"
+          "\t-n <count>        : Number of images; the test pattern moves by "
+          "a pixel each.\n"
+          "\t                    Default: 1, or endless with -t.\n"
+          "\t-F <frames>       : Refreshed frames to collect per image "
+          "(Default: 4).\n"
+          "\t-L                : Write the linear light output instead of "
+          "undoing the\n"
+          "\t                    luminance correction.\n");
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+// If "pattern" is usable as printf() format for the image number: at most one
+// conversion, which is a %d with optional flags and width, e.g. out-%03d.ppm.
+static bool IsImageNumberPattern(const char *pattern) {
+  int conversions = 0;
+  for (const char *p = pattern; *p; ++p) {
+    if (*p != '%') continue;
+    if (*++p == '%') continue;
+    while (*p == '0' || *p == '-' || *p == ' ' || *p == '+') ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p != 'd' || ++conversions > 1)
+      return false;
+  }
+  return true;
+}
+
+// Binary PPM (P6) with 8 bit per color.
+static bool LoadPPM(const char *filename, int *width, int *height,
+                    std::vector<uint8_t> *rgb) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  char magic[3] = { 0 };
+  int maxval = 0;
+  bool success = (fscanf(f, "%2s", magic) == 1 && strcmp(magic, "P6") == 0);
+  int *const values[3] = { width, height, &maxval };
+  for (int i = 0; success && i < 3; ++i) {
+    int c;
+    while ((c = fgetc(f)) == '#' || isspace(c)) {
+      if (c == '#') while ((c = fgetc(f)) != '\n' && c != EOF) {}
+    }
+    ungetc(c, f);
+    success = (fscanf(f, "%d", values[i]) == 1);
+  }
+  success = success && maxval == 255 && fgetc(f) != EOF;
+  if (success) {
+    rgb->resize(*width * *height * 3);
+    success = fread(rgb->data(), 1, rgb->size(), f) == rgb->size();
+  }
+  fclose(f);
+  if (!success) fprintf(stderr, "%s: not a binary 8 bit PPM\n", filename);
+  return success;
+}
+
+static void DrawTestPattern(Canvas *c, int offset) {
+  const int w = c->width();
+  const int h = c->height();
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      const int px = (x + offset) % w;
+      if (x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+        c->SetPixel(x, y, 255, 255, 255);  // Frame to see the corners.
+      } else if (px == y % w) {
+        c->SetPixel(x, y, 255, 255, 0);    // Moving diagonal.
+      } else {
+        c->SetPixel(x, y, 255 * px / w, 255 * y / h, 255 - 255 * px / w);
+      }
+    }
+  }
+}
+
+static void DrawImage(Canvas *c, int width, int height,
+                      const std::vector<uint8_t> &rgb) {
+  c->Clear();
+  for (int y = 0; y < height && y < c->height(); ++y) {
+    for (int x = 0; x < width && x < c->width(); ++x) {
+      const uint8_t *p = &rgb[(y * width + x) * 3];
+      c->SetPixel(x, y, p[0], p[1], p[2]);
+    }
+  }
+}
+
+// Back from the light output to the color value that was set, reversing the
+// CIE1931 luminance correction of the library.
+static uint8_t ToColorValue(float light, bool linear) {
+  if (linear) return roundf(255 * light);
+  const float lightness = (light <= 0.008856f)
+    ? light * 902.3f
+    : 116.0f * cbrtf(light) - 16.0f;
+  const float value = roundf(lightness * 255 / 100);
+  return value > 255 ? 255 : value;
+}
+
+static bool WritePPM(const char *filename, int width, int height,
+                     const std::vector<uint8_t> &rgb) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  fwrite(rgb.data(), 1, rgb.size(), f);
+  return fclose(f) == 0;
+}
+
+// Two rows per line with the upper half block character.
+static void ShowInTerminal(int width, int height,
+                           const std::vector<uint8_t> &rgb) {
+  printf("\033[H");
+  for (int y = 0; y < height; y += 2) {
+    for (int x = 0; x < width; ++x) {
+      const uint8_t *top = &rgb[(y * width + x) * 3];
+      static const uint8_t kBlack[3] = { 0, 0, 0 };
+      const uint8_t *bottom = (y + 1 < height) ? top + width * 3 : kBlack;
+      printf("\033[38;2;%d;%d;%dm\033[48;2;%d;%d;%dm▀",
+             top[0], top[1], top[2], bottom[0], bottom[1], bottom[2]);
+    }
+    printf("\033[0m\n");
+  }
+  fflush(stdout);
+}
+
+static void WaitFrames(RGBMatrix *matrix, int frames) {
+  const uint64_t until = matrix->GetRefreshStats().frames + frames;
+  while (matrix->GetRefreshStats().frames < until && !interrupt_received) {
+    usleep(1000);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  runtime_opt.drop_privileges = 0;  // Nothing to drop, no hardware touched.
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  const char *output = NULL;
+  bool terminal = false;
+  int count = -1;
+  int frames_per_image = 4;
+  bool linear = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:tn:F:L")) != -1) {
+    switch (opt) {
+    case 'o': output = strdup(optarg); break;
+    case 't': terminal = true; break;
+    case 'n': count = atoi(optarg); break;
+    case 'F': frames_per_image = atoi(optarg); break;
+    case 'L': linear = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (!output && !terminal) {
+    fprintf(stderr, "Need -o and/or -t to see any output.\n");
+    return usage(argv[0]);
+  }
+  if (output && !IsImageNumberPattern(output)) {
+    fprintf(stderr, "-o %s: only a single %%d for the image number is "
+            "allowed; use %%%% for a literal %%.\n", output);
+    return usage(argv[0]);
+  }
+  if (frames_per_image < 1) {
+    fprintf(stderr, "-F needs at least one frame.\n");
+    return usage(argv[0]);
+  }
+  if (count < 0) count = terminal ? 0 : 1;  // 0: endless.
+
+  int image_width = 0, image_height = 0;
+  std::vector<uint8_t> image;
+  if (optind < argc && !LoadPPM(argv[optind], &image_width, &image_height,
+                                &image)) {
+    return 1;
+  }
+
+  PanelEmulator emulator(matrix_options);
+  runtime_opt.gpio_recorder = &emulator;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  if (terminal) printf("\033[2J");
+
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  std::vector<float> light;
+  std::vector<uint8_t> rgb;
+  for (int i = 0; (count == 0 || i < count) && !interrupt_received; ++i) {
+    if (image.empty()) {
+      DrawTestPattern(offscreen, i);
+    } else {
+      DrawImage(offscreen, image_width, image_height, image);
+    }
+    offscreen = matrix->SwapOnVSync(offscreen);
+    WaitFrames(matrix, 1);  // The previous content is out now.
+    emulator.Reset();
+    WaitFrames(matrix, frames_per_image);
+    emulator.GetImage(&light);
+
+    rgb.resize(light.size());
+    for (size_t c = 0; c < light.size(); ++c) {
+      rgb[c] = ToColorValue(light[c], linear);
+    }
+    if (terminal) {
+      ShowInTerminal(emulator.width(), emulator.height(), rgb);
+    }
+    if (output) {
+      char filename[1024];
+      snprintf(filename, sizeof(filename), output, i);
+      if (!WritePPM(filename, emulator.width(), emulator.height(), rgb))
+        break;
+    }
+  }
+
+  delete matrix;
+  return 0;
+}
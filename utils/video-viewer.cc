@@ -67,6 +67,12 @@ struct LedPixel {
 void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas,
                int offset_x, int offset_y,
                int width, int height) {
+  if (offset_x == 0 && offset_y == 0
+      && width == canvas->width() && height == canvas->height()) {
+    // Frame covers the full canvas: convert it in one go.
+    canvas->SetFromRGBBuffer(pFrame->data[0], pFrame->linesize[0]);
+    return;
+  }
   for (int y = 0; y < height; ++y) {
     LedPixel *pix = (LedPixel*) (pFrame->data[0] + y*pFrame->linesize[0]);
     for (int x = 0; x < width; ++x, ++pix) {